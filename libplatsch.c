@@ -23,6 +23,7 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
 #include <libgen.h>
@@ -31,6 +32,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -40,6 +44,10 @@
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
 #include "libplatsch.h"
 
 #define debug(fmt, ...) printf("%s:%d: " fmt, __func__, __LINE__, ##__VA_ARGS__)
@@ -47,6 +55,16 @@
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(*a))
 
+/* since Linux 6.8, not yet in the headers of older libdrm versions */
+#ifndef DRM_IOCTL_MODE_CLOSEFB
+struct drm_mode_closefb {
+	__u32 fb_id;
+	__u32 pad;
+};
+
+#define DRM_IOCTL_MODE_CLOSEFB	DRM_IOWR(0xD0, struct drm_mode_closefb)
+#endif
+
 struct platsch_format {
 	uint32_t format;
 	uint32_t bpp;
@@ -58,6 +76,94 @@ static const struct platsch_format platsch_formats[] = {
 	{ DRM_FORMAT_XRGB8888, 32, "XRGB8888" },
 };
 
+enum platsch_load_method {
+	PLATSCH_LOAD_CACHED = 0,
+	/* drop the image from the page cache after loading it */
+	PLATSCH_LOAD_DROP,
+	/* read the image with O_DIRECT, bypassing the page cache */
+	PLATSCH_LOAD_DIRECT,
+};
+
+enum platsch_fade_method {
+	PLATSCH_FADE_UNPREPARED = 0,
+	PLATSCH_FADE_NONE,
+	PLATSCH_FADE_GAMMA_LUT,
+	PLATSCH_FADE_LEGACY_GAMMA,
+	PLATSCH_FADE_ALPHA,
+	PLATSCH_FADE_BACKLIGHT,
+};
+
+/* 5x7 pixel glyphs for the characters from ' ' to '_', MSB is the left column */
+static const uint8_t platsch_font[][7] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* space */
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, /* ! */
+	{ 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00 }, /* " */
+	{ 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a }, /* # */
+	{ 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 }, /* $ */
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, /* % */
+	{ 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d }, /* & */
+	{ 0x0c, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 }, /* ' */
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, /* ( */
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, /* ) */
+	{ 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 }, /* * */
+	{ 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 }, /* + */
+	{ 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 }, /* , */
+	{ 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 }, /* - */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c }, /* . */
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, /* / */
+	{ 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e }, /* 0 */
+	{ 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* 1 */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f }, /* 2 */
+	{ 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e }, /* 3 */
+	{ 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 }, /* 4 */
+	{ 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e }, /* 5 */
+	{ 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e }, /* 6 */
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, /* 7 */
+	{ 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e }, /* 8 */
+	{ 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c }, /* 9 */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 }, /* : */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 }, /* ; */
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, /* < */
+	{ 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 }, /* = */
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, /* > */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 }, /* ? */
+	{ 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e }, /* @ */
+	{ 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, /* A */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e }, /* B */
+	{ 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e }, /* C */
+	{ 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c }, /* D */
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f }, /* E */
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 }, /* F */
+	{ 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f }, /* G */
+	{ 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, /* H */
+	{ 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* I */
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c }, /* J */
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, /* K */
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f }, /* L */
+	{ 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 }, /* M */
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, /* N */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, /* O */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 }, /* P */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d }, /* Q */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 }, /* R */
+	{ 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e }, /* S */
+	{ 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, /* T */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, /* U */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 }, /* V */
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a }, /* W */
+	{ 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 }, /* X */
+	{ 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 }, /* Y */
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f }, /* Z */
+	{ 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e }, /* [ */
+	{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 }, /* \ */
+	{ 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e }, /* ] */
+	{ 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 }, /* ^ */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f }, /* _ */
+};
+
+#define FONT_WIDTH	5
+#define FONT_HEIGHT	7
+
 struct modeset_dev {
 	struct modeset_dev *next;
 
@@ -74,17 +180,108 @@ struct modeset_dev {
 	uint32_t fb_id;
 	uint32_t conn_id;
 	uint32_t crtc_id;
+	int crtc_idx;
+
+	/* built-in panel, the only kind of output the backlight belongs to */
+	bool internal;
+	/* set when unplugged, the buffer is kept for reuse */
+	bool disconnected;
+	bool reused;
+	/* the splash image was loaded already, see platsch_load_images() */
+	bool loaded;
+	/* nothing was drawn yet, the buffer holds the kernel's zeroes */
+	bool clean;
+
+	/* the image behind the message line, saved when drawing the first one */
+	void *msg_bg;
+
+	/* primary plane, only set for atomic modesetting */
+	uint32_t plane_id;
+
+	enum platsch_fade_method fade_method;
+	uint32_t gamma_lut_prop;
+	uint32_t gamma_size;
+	uint32_t gamma_blob;
+	uint32_t alpha_prop;
 };
 
-struct platsch_ctx {
+struct platsch_card;
+
+typedef int (*card_fn)(struct platsch_card *card);
+
+/* user data of all DRM events requested by libplatsch */
+struct platsch_event {
+	void (*handler)(struct platsch_event *event);
+};
+
+struct platsch_frame {
+	struct platsch_event event;
+	struct platsch_card *card;
+	platsch_frame_cb cb;
+	void *priv;
+	bool pending;
+};
+
+struct platsch_card {
+	struct platsch_card *next;
+	struct platsch_ctx *ctx;
+
 	struct modeset_dev *modeset_list;
+	char *path;
 	int drmfd;
+	/* false if the fd was passed in by the user */
+	bool own_fd;
+	bool atomic;
+	/* show outputs right away in drmprepare() */
+	bool pipelined;
+
+	/* resources retrieved while probing, handed over to drmprepare() */
+	drmModeRes *res;
+
+	/* used by platsch_for_each_card() */
+	card_fn fn;
+	pthread_t thread;
+	bool threaded;
+	int ret;
+};
+
+struct platsch_ctx {
+	struct platsch_card *cards;
+	unsigned int crossfade_frames;
+	/* use the connector state known already instead of probing */
+	bool probe_current;
+	/* how long to wait for a connector probe, 0 waits forever */
+	unsigned int probe_timeout_ms;
+	/* platsch_connectors, which connectors to use */
+	char *connectors;
+	/* platsch_load, how to read splash images */
+	enum platsch_load_method load;
+	/* platsch_timings, print how long the setup phases take */
+	bool timings;
+	uint16_t level;
+	int backlight_fd;
+	/* brightness when starting, which full level restores */
+	uint32_t backlight_full;
 	char *dir;
 	char *base;
+	/* topology cache file and its contents when starting */
+	char *cache_path;
+	char *cache_data;
 	custom_draw_cb custom_draw_buffer_cb;
 	void *custom_draw_priv;
+	struct platsch_frame frame;
 };
 
+static unsigned int elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
 static ssize_t readfull(int fd, void *buf, size_t count)
 {
 	ssize_t ret = 0, err;
@@ -105,39 +302,126 @@ static ssize_t readfull(int fd, void *buf, size_t count)
 	return ret;
 }
 
+/* Returns the NUL terminated contents of a small text file or NULL */
+static char *read_file(const char *path)
+{
+	char *buf = NULL;
+	struct stat st;
+	ssize_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size > 65536)
+		goto out;
+
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		goto out;
+
+	size = readfull(fd, buf, st.st_size);
+	if (size < 0) {
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	buf[size] = '\0';
+
+out:
+	close(fd);
+
+	return buf;
+}
+
+/*
+ * make it easy and load a raw file in the right format instead of opening an
+ * (say) PNG and convert the image data to the right format.
+ */
+static char *platsch_image_name(struct platsch_ctx *ctx, struct modeset_dev *dev)
+{
+	char *filename;
+
+	if (asprintf(&filename, "%s/%s-%ux%u-%s.bin", ctx->dir, ctx->base,
+		     dev->width, dev->height, dev->format->name) < 0) {
+		error("Failed to allocate filename buffer\n");
+		return NULL;
+	}
+
+	return filename;
+}
+
+/* clear what a short image load left undrawn unless the kernel zeroed it */
+static void modeset_clear_tail(struct modeset_dev *dev, ssize_t drawn)
+{
+	if (drawn < 0)
+		drawn = 0;
+
+	if (dev->clean || drawn >= dev->size)
+		return;
+
+	memset(dev->map + drawn, 0x0, dev->size - drawn);
+}
+
+static void platsch_drop_cache(const char *filename)
+{
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
 static void platsch_draw_buffer(struct platsch_ctx *ctx, struct modeset_dev *dev)
 {
-	const char *base = ctx->base;
-	const char *dir = ctx->dir;
-	int fd_src;
+	int fd_src = -1;
 	char *filename;
 	ssize_t size;
 	int ret;
 
-	/*
-	 * make it easy and load a raw file in the right format instead of
-	 * opening an (say) PNG and convert the image data to the right format.
-	 */
-	ret = asprintf(&filename, "%s/%s-%ux%u-%s.bin",
-		       dir, base, dev->width, dev->height, dev->format->name);
-	if (ret < 0) {
-		error("Failed to allocate filename buffer\n");
+	filename = platsch_image_name(ctx, dev);
+	if (!filename)
 		return;
-	}
 
-	fd_src = open(filename, O_RDONLY | O_CLOEXEC);
+	if (ctx->load == PLATSCH_LOAD_DIRECT)
+		fd_src = open(filename, O_RDONLY | O_CLOEXEC | O_DIRECT);
+
+	/* EINVAL: the filesystem doesn't support O_DIRECT */
+	if (fd_src < 0 && (ctx->load != PLATSCH_LOAD_DIRECT || errno == EINVAL))
+		fd_src = open(filename, O_RDONLY | O_CLOEXEC);
 	if (fd_src < 0) {
 		error("Failed to open %s: %m\n", filename);
+		modeset_clear_tail(dev, 0);
 		goto out;
 	}
 
 	size = readfull(fd_src, dev->map, dev->size);
+	if (size < 0 && (errno == EFAULT || errno == EINVAL) &&
+	    ctx->load == PLATSCH_LOAD_DIRECT) {
+		/*
+		 * Not every driver's buffers can be used for direct I/O and
+		 * the buffer might not be aligned as required, read it through
+		 * the page cache then.
+		 */
+		debug("Cannot read %s with O_DIRECT: %m\n", filename);
+		if (!fcntl(fd_src, F_SETFL, 0) && !lseek(fd_src, 0, SEEK_SET))
+			size = readfull(fd_src, dev->map, dev->size);
+	}
+
+	if (ctx->load != PLATSCH_LOAD_CACHED)
+		posix_fadvise(fd_src, 0, 0, POSIX_FADV_DONTNEED);
+
 	if (size < dev->size) {
 		if (size < 0)
 			error("Failed to read from %s: %m\n", filename);
 		else
 			error("Could only read %zd/%u bytes from %s\n",
 			      size, dev->size, filename);
+		modeset_clear_tail(dev, size);
 	}
 
 	ret = close(fd_src);
@@ -166,7 +450,7 @@ static void platsch_custom_draw_buffer(struct platsch_ctx *ctx,
 	ctx->custom_draw_buffer_cb(&buf, ctx->custom_draw_priv);
 }
 
-static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
+static int drmprepare_crtc(struct platsch_card *card, drmModeRes *res,
 			   drmModeConnector *conn, struct modeset_dev *dev)
 {
 	drmModeEncoder *enc;
@@ -178,7 +462,7 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 	if (conn->encoder_id) {
 		debug("connector #%d uses encoder #%d\n", conn->connector_id,
 		      conn->encoder_id);
-		enc = drmModeGetEncoder(ctx->drmfd, conn->encoder_id);
+		enc = drmModeGetEncoder(card->drmfd, conn->encoder_id);
 		assert(enc);
 		assert(enc->encoder_id == conn->encoder_id);
 	} else {
@@ -193,7 +477,7 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 			crtc_id = enc->crtc_id;
 			bool in_use = false;
 
-			for (iter = ctx->modeset_list; iter; iter = iter->next) {
+			for (iter = card->modeset_list; iter; iter = iter->next) {
 				if (iter->crtc_id == crtc_id) {
 					in_use = true;
 					break;
@@ -205,6 +489,9 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 				      enc->encoder_id, enc->crtc_id);
 				drmModeFreeEncoder(enc);
 				dev->crtc_id = crtc_id;
+				for (j = 0; j < res->count_crtcs; ++j)
+					if (res->crtcs[j] == crtc_id)
+						dev->crtc_idx = j;
 				return 0;
 			} else {
 				debug("encoder #%d used crtc #%d, but that's in use\n",
@@ -223,7 +510,7 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 	 * but let's be safe), iterate all other available encoders to find a
 	 * matching CRTC. */
 	for (i = 0; i < conn->count_encoders; ++i) {
-		enc = drmModeGetEncoder(ctx->drmfd, conn->encoders[i]);
+		enc = drmModeGetEncoder(card->drmfd, conn->encoders[i]);
 		if (!enc) {
 			error("Cannot retrieve encoder %u: %m\n",
 			      conn->encoders[i]);
@@ -241,7 +528,7 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 
 			/* check that no other device already uses this CRTC */
 			crtc_id = res->crtcs[j];
-			for (iter = ctx->modeset_list; iter; iter = iter->next) {
+			for (iter = card->modeset_list; iter; iter = iter->next) {
 				if (iter->crtc_id == crtc_id) {
 					in_use = true;
 					break;
@@ -254,6 +541,7 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 				      enc->encoder_id, crtc_id);
 				drmModeFreeEncoder(enc);
 				dev->crtc_id = crtc_id;
+				dev->crtc_idx = j;
 				return 0;
 			}
 
@@ -266,12 +554,41 @@ static int drmprepare_crtc(struct platsch_ctx *ctx, drmModeRes *res,
 	return -ENOENT;
 }
 
-static int modeset_create_fb(struct platsch_ctx *ctx, struct modeset_dev *dev)
+/* map the dumb buffer of dev unless it is already */
+static int modeset_map_fb(struct platsch_card *card, struct modeset_dev *dev)
+{
+	struct drm_mode_map_dumb mreq;
+	void *map;
+
+	if (dev->map)
+		return 0;
+
+	/* prepare buffer for memory mapping */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.handle = dev->handle;
+	if (drmIoctl(card->drmfd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) {
+		error("Cannot get mmap offset: %m\n");
+		return -errno;
+	}
+
+	/* perform actual memory mapping */
+	map = mmap(0, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   card->drmfd, mreq.offset);
+	if (map == MAP_FAILED) {
+		error("Cannot mmap dumb buffer: %m\n");
+		return -errno;
+	}
+
+	dev->map = map;
+
+	return 0;
+}
+
+static int modeset_create_fb(struct platsch_card *card, struct modeset_dev *dev)
 {
 	struct drm_mode_create_dumb creq;
 	struct drm_mode_destroy_dumb dreq;
-	struct drm_mode_map_dumb mreq;
-	int fd = ctx->drmfd;
+	int fd = card->drmfd;
 	int ret;
 
 	/* create dumb buffer */
@@ -301,30 +618,17 @@ static int modeset_create_fb(struct platsch_ctx *ctx, struct modeset_dev *dev)
 		goto err_destroy;
 	}
 
-	/* prepare buffer for memory mapping */
-	memset(&mreq, 0, sizeof(mreq));
-	mreq.handle = dev->handle;
-	ret = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
-	if (ret) {
-		ret = -errno;
-		error("Cannot get mmap offset: %m\n");
-		goto err_fb;
-	}
-
-	/* perform actual memory mapping */
-	dev->map = mmap(0, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED,
-			fd, mreq.offset);
-	if (dev->map == MAP_FAILED) {
-		ret = -errno;
-		error("Cannot mmap dumb buffer: %m\n");
+	ret = modeset_map_fb(card, dev);
+	if (ret)
 		goto err_fb;
-	}
 
 	/*
-	 * Clear the framebuffer. Normally it's overwritten later with some
-	 * image data, but in case this fails, initialize to all-black.
+	 * Dumb buffers come zeroed (i.e. black) from the kernel, so there's no
+	 * need to clear it before the image is drawn. Only what a failing image
+	 * load leaves undrawn in a used buffer is cleared, see
+	 * modeset_clear_tail().
 	 */
-	memset(dev->map, 0x0, dev->size);
+	dev->clean = true;
 
 	return 0;
 
@@ -337,6 +641,250 @@ err_destroy:
 	return ret;
 }
 
+static void modeset_destroy_fb(struct platsch_card *card, struct modeset_dev *dev)
+{
+	struct drm_mode_destroy_dumb dreq;
+
+	if (dev->map) {
+		munmap(dev->map, dev->size);
+		dev->map = NULL;
+	}
+
+	/* no fb_id after platsch_keep_scanout(), the kernel keeps it around */
+	if (dev->fb_id) {
+		drmModeRmFB(card->drmfd, dev->fb_id);
+		dev->fb_id = 0;
+	}
+
+	if (dev->handle) {
+		memset(&dreq, 0, sizeof(dreq));
+		dreq.handle = dev->handle;
+		drmIoctl(card->drmfd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+		dev->handle = 0;
+	}
+}
+
+/*
+ * Take over the buffer of a disconnected connector with the same size and
+ * format. It still contains the splash, so it doesn't need to be drawn again.
+ */
+static bool modeset_reuse_fb(struct platsch_card *card, struct modeset_dev *dev)
+{
+	struct modeset_dev *iter;
+
+	for (iter = card->modeset_list; iter; iter = iter->next) {
+		if (!iter->disconnected || !iter->fb_id ||
+		    iter->width != dev->width || iter->height != dev->height ||
+		    iter->format != dev->format)
+			continue;
+
+		debug("reusing framebuffer of connector #%u for connector #%u\n",
+		      iter->conn_id, dev->conn_id);
+
+		dev->stride = iter->stride;
+		dev->size = iter->size;
+		dev->handle = iter->handle;
+		dev->map = iter->map;
+		dev->fb_id = iter->fb_id;
+		dev->reused = true;
+
+		iter->handle = 0;
+		iter->map = NULL;
+		iter->fb_id = 0;
+
+		return true;
+	}
+
+	return false;
+}
+
+/* Returns the id of the named property of a KMS object or 0 if there is none */
+static uint32_t drm_get_prop_id(int fd, uint32_t obj_id, uint32_t obj_type,
+				const char *name)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	uint32_t prop_id = 0;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !prop_id; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, name))
+			prop_id = prop->prop_id;
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return prop_id;
+}
+
+static int drm_get_prop_value(int fd, uint32_t obj_id, uint32_t obj_type,
+			      const char *name, uint64_t *value)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	int ret = -ENOENT;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return -errno;
+
+	for (i = 0; i < props->count_props && ret; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, name)) {
+			*value = props->prop_values[i];
+			ret = 0;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return ret;
+}
+
+static int drm_atomic_add(drmModeAtomicReq *req, int fd, uint32_t obj_id,
+			  uint32_t obj_type, const char *name, uint64_t value)
+{
+	uint32_t prop_id;
+	int ret;
+
+	prop_id = drm_get_prop_id(fd, obj_id, obj_type, name);
+	if (!prop_id) {
+		error("Object #%u has no property %s\n", obj_id, name);
+		return -ENOENT;
+	}
+
+	ret = drmModeAtomicAddProperty(req, obj_id, prop_id, value);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
+/* find the primary plane that can be used with the crtc of dev */
+static int drmprepare_plane(struct platsch_card *card, struct modeset_dev *dev)
+{
+	drmModePlaneRes *planes;
+	drmModePlane *plane;
+	uint64_t type;
+	uint32_t i;
+	int ret = -ENOENT;
+
+	planes = drmModeGetPlaneResources(card->drmfd);
+	if (!planes) {
+		error("Cannot retrieve plane resources: %m\n");
+		return -errno;
+	}
+
+	for (i = 0; i < planes->count_planes && ret; i++) {
+		plane = drmModeGetPlane(card->drmfd, planes->planes[i]);
+		if (!plane)
+			continue;
+
+		if ((plane->possible_crtcs & (1 << dev->crtc_idx)) &&
+		    !drm_get_prop_value(card->drmfd, plane->plane_id,
+					DRM_MODE_OBJECT_PLANE, "type", &type) &&
+		    type == DRM_PLANE_TYPE_PRIMARY) {
+			debug("crtc #%u uses primary plane #%u\n",
+			      dev->crtc_id, plane->plane_id);
+			dev->plane_id = plane->plane_id;
+			ret = 0;
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(planes);
+
+	return ret;
+}
+
+/*
+ * Set mode and framebuffer in a single atomic commit. Contrary to
+ * drmModeSetCrtc() this allows the framebuffer to have a different size than
+ * the mode, in which case the plane scales it.
+ */
+static int modeset_atomic_commit(struct platsch_card *card,
+				 struct modeset_dev *dev, uint32_t flags)
+{
+	struct {
+		uint32_t obj_id;
+		uint32_t obj_type;
+		const char *name;
+		uint64_t value;
+	} props[] = {
+		{ dev->conn_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", dev->crtc_id },
+		{ dev->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", 0 /* see below */ },
+		{ dev->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", 1 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", dev->fb_id },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_ID", dev->crtc_id },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_X", 0 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_Y", 0 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_W",
+		  (uint64_t)dev->width << 16 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "SRC_H",
+		  (uint64_t)dev->height << 16 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_X", 0 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_Y", 0 },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_W", dev->mode.hdisplay },
+		{ dev->plane_id, DRM_MODE_OBJECT_PLANE, "CRTC_H", dev->mode.vdisplay },
+	};
+	drmModeAtomicReq *req;
+	uint32_t mode_blob;
+	int fd = card->drmfd;
+	unsigned i;
+	int ret;
+
+	ret = drmModeCreatePropertyBlob(fd, &dev->mode, sizeof(dev->mode),
+					&mode_blob);
+	if (ret) {
+		error("Cannot create mode blob: %m\n");
+		return -errno;
+	}
+	props[1].value = mode_blob;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		ret = -ENOMEM;
+		goto out_blob;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(props); i++) {
+		ret = drm_atomic_add(req, fd, props[i].obj_id, props[i].obj_type,
+				     props[i].name, props[i].value);
+		if (ret)
+			goto out_req;
+	}
+
+	ret = drmModeAtomicCommit(fd, req,
+				  flags | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (ret)
+		ret = -errno;
+
+out_req:
+	drmModeAtomicFree(req);
+out_blob:
+	/* a successful commit holds its own reference to the blob */
+	drmModeDestroyPropertyBlob(fd, mode_blob);
+
+	return ret;
+}
+
 /* Returns lowercase connector type names with '_' for '-' */
 static char *get_normalized_conn_type_name(uint32_t connector_type)
 {
@@ -359,6 +907,49 @@ static char *get_normalized_conn_type_name(uint32_t connector_type)
 	return normalized_name;
 }
 
+/*
+ * Check a connector against a list of connector names (e.g. "hdmi_a1") or
+ * types (e.g. "hdmi_a") to use, a leading '-' excludes a connector instead.
+ * The first match wins. Without a match a connector is used if there are only
+ * exclusions.
+ */
+static bool connector_allowed(const char *filter, drmModeConnector *conn)
+{
+	const char *entry, *end;
+	bool deny, has_allow = false;
+	char *type, name[64];
+	size_t len;
+
+	if (!filter)
+		return true;
+
+	type = get_normalized_conn_type_name(conn->connector_type);
+	if (!type)
+		return true;
+	snprintf(name, sizeof(name), "%s%u", type, conn->connector_type_id);
+
+	for (entry = filter; *entry; entry = *end ? end + 1 : end) {
+		end = entry + strcspn(entry, ", ");
+		if (end == entry)
+			continue;
+
+		deny = *entry == '-';
+		len = end - entry - deny;
+		if (!deny)
+			has_allow = true;
+
+		if ((strlen(name) == len && !strncmp(entry + deny, name, len)) ||
+		    (strlen(type) == len && !strncmp(entry + deny, type, len))) {
+			free(type);
+			return !deny;
+		}
+	}
+
+	free(type);
+
+	return !has_allow;
+}
+
 static const struct platsch_format *platsch_format_find(const char *name)
 {
 	unsigned i;
@@ -370,30 +961,43 @@ static const struct platsch_format *platsch_format_find(const char *name)
 	return NULL;
 }
 
-static int set_env_connector_mode(drmModeConnector *conn,
-				  struct modeset_dev *dev)
+/* Returns the name of the env variable platsch_<connector>_<setting> */
+static char *get_env_connector_name(drmModeConnector *conn, const char *setting)
 {
-	int ret, i = 0;
-	u_int32_t width = 0, height = 0;
-	const char *mode;
-	char *connector_type_name, *mode_env_name = NULL, fmt_specifier[32] = "";
-	const struct platsch_format *format = NULL;
+	char *connector_type_name, *env_name;
+	int ret;
 
 	connector_type_name = get_normalized_conn_type_name(conn->connector_type);
 	if (!connector_type_name) {
 		error("could not look up name for connector type %u\n",
 		      conn->connector_type);
-		goto fallback;
+		return NULL;
 	}
 
-	ret = asprintf(&mode_env_name, "platsch_%s%u_mode",
-		       connector_type_name, conn->connector_type_id);
+	ret = asprintf(&env_name, "platsch_%s%u_%s", connector_type_name,
+		       conn->connector_type_id, setting);
 	free(connector_type_name);
 	if (ret < 0) {
-		error("failed to allocate platsch env mode variable\n");
-		return -ENOMEM;
+		error("failed to allocate platsch env %s variable\n", setting);
+		return NULL;
 	}
 
+	return env_name;
+}
+
+static int set_env_connector_mode(drmModeConnector *conn,
+				  struct modeset_dev *dev)
+{
+	int ret, i = 0;
+	u_int32_t width = 0, height = 0;
+	const char *mode;
+	char *mode_env_name = NULL, fmt_specifier[32] = "";
+	const struct platsch_format *format = NULL;
+
+	mode_env_name = get_env_connector_name(conn, "mode");
+	if (!mode_env_name)
+		goto fallback;
+
 	/* check for connector mode configuration in environment */
 	debug("looking up %s env variable\n", mode_env_name);
 	mode = getenv(mode_env_name);
@@ -457,16 +1061,68 @@ err_out:
 	return ret;
 }
 
-static int drmprepare_connector(struct platsch_ctx *ctx, drmModeRes *res,
-				drmModeConnector *conn, struct modeset_dev *dev)
+/*
+ * The framebuffer defaults to the size of the mode. If it is configured to be
+ * smaller (or larger), the plane scales it to the mode.
+ */
+static void set_env_connector_fbsize(drmModeConnector *conn,
+				     struct modeset_dev *dev)
 {
-	int ret;
+	uint32_t width, height;
+	const char *fbsize;
+	char *fbsize_env_name;
 
-	/* check if a monitor is connected */
-	if (conn->connection != DRM_MODE_CONNECTED) {
-		error("Ignoring unused connector #%u\n", conn->connector_id);
-		return -ENOENT;
-	}
+	fbsize_env_name = get_env_connector_name(conn, "fbsize");
+	if (!fbsize_env_name)
+		return;
+
+	debug("looking up %s env variable\n", fbsize_env_name);
+	fbsize = getenv(fbsize_env_name);
+	if (!fbsize)
+		goto out;
+
+	if (sscanf(fbsize, "%ux%u", &width, &height) != 2 || !width || !height) {
+		error("error while scanning %s for framebuffer size\n",
+		      fbsize_env_name);
+		goto out;
+	}
+
+	dev->width = width;
+	dev->height = height;
+
+out:
+	free(fbsize_env_name);
+}
+
+static bool modeset_is_scaled(struct modeset_dev *dev)
+{
+	return dev->width != dev->mode.hdisplay ||
+	       dev->height != dev->mode.vdisplay;
+}
+
+static bool connector_is_internal(drmModeConnector *conn)
+{
+	switch (conn->connector_type) {
+	case DRM_MODE_CONNECTOR_LVDS:
+	case DRM_MODE_CONNECTOR_eDP:
+	case DRM_MODE_CONNECTOR_DSI:
+	case DRM_MODE_CONNECTOR_DPI:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int drmprepare_connector(struct platsch_card *card, drmModeRes *res,
+				drmModeConnector *conn, struct modeset_dev *dev)
+{
+	int ret;
+
+	/* check if a monitor is connected */
+	if (conn->connection != DRM_MODE_CONNECTED) {
+		error("Ignoring unused connector #%u\n", conn->connector_id);
+		return -ENOENT;
+	}
 
 	/* check if there is at least one valid mode */
 	if (conn->count_modes == 0) {
@@ -474,6 +1130,8 @@ static int drmprepare_connector(struct platsch_ctx *ctx, drmModeRes *res,
 		return -EFAULT;
 	}
 
+	dev->internal = connector_is_internal(conn);
+
 	/* configure mode information in our device structure */
 	ret = set_env_connector_mode(conn, dev);
 	if (ret) {
@@ -483,238 +1141,2549 @@ static int drmprepare_connector(struct platsch_ctx *ctx, drmModeRes *res,
 	debug("mode for connector #%u is %ux%u@%s\n",
 	      conn->connector_id, dev->width, dev->height, dev->format->name);
 
+	if (card->atomic)
+		set_env_connector_fbsize(conn, dev);
+
 	/* find a crtc for this connector */
-	ret = drmprepare_crtc(ctx, res, conn, dev);
+	ret = drmprepare_crtc(card, res, conn, dev);
 	if (ret) {
 		error("no valid crtc for connector #%u\n", conn->connector_id);
 		return ret;
 	}
 
+	/* the plane is only needed for scaling, fading looks it up itself */
+	if (card->atomic && modeset_is_scaled(dev) &&
+	    drmprepare_plane(card, dev))
+		error("no primary plane for connector #%u\n", conn->connector_id);
+
+	if (modeset_is_scaled(dev)) {
+		debug("framebuffer for connector #%u is %ux%u\n",
+		      conn->connector_id, dev->width, dev->height);
+
+		if (!dev->plane_id) {
+			error("cannot scale without plane on connector #%u\n",
+			      conn->connector_id);
+			dev->width = dev->mode.hdisplay;
+			dev->height = dev->mode.vdisplay;
+		}
+	}
+
 	/* create a framebuffer for this CRTC */
-	ret = modeset_create_fb(ctx, dev);
+	if (modeset_reuse_fb(card, dev))
+		ret = 0;
+	else
+		ret = modeset_create_fb(card, dev);
 	if (ret) {
 		error("cannot create framebuffer for connector #%u\n",
 		      conn->connector_id);
 		return ret;
 	}
 
+	if (modeset_is_scaled(dev)) {
+		/* check that the plane can actually scale the framebuffer */
+		ret = modeset_atomic_commit(card, dev, DRM_MODE_ATOMIC_TEST_ONLY);
+		if (!ret)
+			return 0;
+
+		error("cannot scale %ux%u to %ux%u on connector #%u, not scaling\n",
+		      dev->width, dev->height, dev->mode.hdisplay,
+		      dev->mode.vdisplay, conn->connector_id);
+
+		modeset_destroy_fb(card, dev);
+		dev->width = dev->mode.hdisplay;
+		dev->height = dev->mode.vdisplay;
+
+		ret = modeset_create_fb(card, dev);
+		if (ret) {
+			error("cannot create framebuffer for connector #%u\n",
+			      conn->connector_id);
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
-static int drmprepare(struct platsch_ctx *ctx)
+/*
+ * Probing a connector can take long (e.g. reading the EDID over DDC), so use
+ * the state the kernel knows already and probe only connectors whose state is
+ * unknown or that have no modes yet.
+ */
+static drmModeConnector *drm_get_connector(int fd, bool probe_current,
+					   const char *filter, uint32_t conn_id)
 {
-	drmModeRes *res;
 	drmModeConnector *conn;
+
+	if (!probe_current && !filter)
+		return drmModeGetConnector(fd, conn_id);
+
+	conn = drmModeGetConnectorCurrent(fd, conn_id);
+
+	/* excluded connectors are skipped later on, don't probe them */
+	if (conn && !connector_allowed(filter, conn))
+		return conn;
+
+	/*
+	 * Polled connectors (e.g. VGA or HDMI without HPD) might not have been
+	 * polled yet and report a stale state, hence this is opt-in.
+	 */
+	if (conn && probe_current &&
+	    conn->connection != DRM_MODE_UNKNOWNCONNECTION &&
+	    (conn->connection != DRM_MODE_CONNECTED || conn->count_modes))
+		return conn;
+
+	debug("connector #%u needs probing\n", conn_id);
+	drmModeFreeConnector(conn);
+
+	return drmModeGetConnector(fd, conn_id);
+}
+
+static void platsch_show_dev(struct platsch_card *card,
+			     struct modeset_dev *dev);
+
+/*
+ * Connectors probed by a worker thread, shared with the card thread consuming
+ * them. Whoever drops the last reference frees it, as the worker might still
+ * hang in a probe after the card thread gave up.
+ */
+struct probe_job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int refs;
+	int fd;
+	bool probe_current;
+	char *filter;
+	bool abandoned;
+	/* a probe timed out, the worker might never return */
+	bool hung;
+	pthread_t thread;
+	bool threaded;
+	int count;
+	/* connectors probed by the worker and handed out by probe_next() */
+	int done;
+	int next;
+	/*
+	 * With pacing, the worker only probes a connector once the consumer is
+	 * done with all before it: a probe holds the modeset locks, which would
+	 * block committing the previous output.
+	 */
+	bool paced;
+	int released;
+	/* when the worker started (or was allowed to start) probing conn_ids[done] */
+	struct timespec started;
+	unsigned int timeout_ms;
+	uint32_t *conn_ids;
+	drmModeConnector **conns;
+};
+
+/* called with the lock held, which is released */
+static void probe_job_put(struct probe_job *job)
+{
+	bool last = !--job->refs;
 	int i;
-	struct modeset_dev *dev;
-	bool root_node = true;
-	int ret;
 
-	/* retrieve resources */
-	res = drmModeGetResources(ctx->drmfd);
-	if (!res) {
-		error("cannot retrieve DRM resources: %m\n");
-		return -errno;
-	}
+	pthread_mutex_unlock(&job->lock);
+	if (!last)
+		return;
 
-	debug("Found %d connectors\n", res->count_connectors);
+	for (i = 0; i < job->count; i++)
+		drmModeFreeConnector(job->conns[i]);
+	pthread_cond_destroy(&job->cond);
+	pthread_mutex_destroy(&job->lock);
+	free(job->filter);
+	free(job->conns);
+	free(job->conn_ids);
+	free(job);
+}
+
+static void *probe_worker(void *arg)
+{
+	struct probe_job *job = arg;
+	drmModeConnector *conn;
+	int i;
+
+	pthread_mutex_lock(&job->lock);
+	for (i = 0; i < job->count && !job->abandoned; i++) {
+		while (job->paced && job->released < i && !job->abandoned)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->abandoned)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &job->started);
+		pthread_mutex_unlock(&job->lock);
 
-	/* iterate all connectors */
-	for (i = 0; i < res->count_connectors; ++i) {
-		/* get information for each connector */
-		conn = drmModeGetConnector(ctx->drmfd, res->connectors[i]);
-		if (!conn) {
+		conn = drm_get_connector(job->fd, job->probe_current, job->filter,
+					 job->conn_ids[i]);
+		if (!conn)
 			error("Cannot retrieve DRM connector #%u: %m\n",
-				res->connectors[i]);
-			continue;
-		}
-		assert(conn->connector_id == res->connectors[i]);
+			      job->conn_ids[i]);
 
-		debug("Connector #%u has type %s\n", conn->connector_id,
-		      drmModeGetConnectorTypeName(conn->connector_type));
+		pthread_mutex_lock(&job->lock);
+		job->conns[i] = conn;
+		job->done = i + 1;
+		pthread_cond_broadcast(&job->cond);
+	}
+	probe_job_put(job);
 
-		/* create a device structure */
-		dev = calloc(1, sizeof(*dev));
-		if (!dev) {
-			error("Cannot allocate memory for connector #%u: %m\n",
-			      res->connectors[i]);
-			continue;
-		}
-		dev->conn_id = conn->connector_id;
+	return NULL;
+}
 
-		ret = drmprepare_connector(ctx, res, conn, dev);
-		if (ret) {
-			if (ret != -ENOENT) {
-				error("Cannot setup device for connector #%u: %m\n",
-				      res->connectors[i]);
-			}
-			free(dev);
-			drmModeFreeConnector(conn);
-			continue;
-		}
+/*
+ * Start probing the connectors of the card in the background, built-in panels
+ * first. Their type is known without probing.
+ */
+static struct probe_job *probe_start(struct platsch_card *card,
+				     drmModeRes *res)
+{
+	drmModeConnector *conn;
+	pthread_condattr_t attr;
+	struct probe_job *job;
+	bool *internal;
+	int i, n = 0;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->count = res->count_connectors;
+	job->conn_ids = malloc(job->count * sizeof(uint32_t));
+	job->conns = calloc(job->count, sizeof(*job->conns));
+	internal = calloc(job->count, sizeof(*internal));
+	if (card->ctx->connectors)
+		job->filter = strdup(card->ctx->connectors);
+	if (!job->conn_ids || !job->conns || !internal) {
+		free(internal);
+		free(job->filter);
+		free(job->conns);
+		free(job->conn_ids);
+		free(job);
+		return NULL;
+	}
 
-		/* free connector data and link device into global list */
+	for (i = 0; i < job->count; i++) {
+		conn = drmModeGetConnectorCurrent(card->drmfd,
+						  res->connectors[i]);
+		internal[i] = conn && connector_is_internal(conn);
 		drmModeFreeConnector(conn);
-		dev->next = root_node ? NULL : ctx->modeset_list;
-		ctx->modeset_list = dev;
+	}
 
-		root_node = false;
+	for (i = 0; i < job->count; i++)
+		if (internal[i])
+			job->conn_ids[n++] = res->connectors[i];
+	for (i = 0; i < job->count; i++)
+		if (!internal[i])
+			job->conn_ids[n++] = res->connectors[i];
+	free(internal);
+
+	/* setting the clock at early boot must not time out the probes */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	job->fd = card->drmfd;
+	job->probe_current = card->ctx->probe_current;
+	job->timeout_ms = card->ctx->probe_timeout_ms;
+	job->paced = card->pipelined;
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	job->refs = 2;
+
+	/* without a thread just do the work here */
+	job->threaded = !pthread_create(&job->thread, NULL, probe_worker, job);
+	if (!job->threaded) {
+		job->paced = false;
+		probe_worker(job);
 	}
 
-	/* free resources again */
-	drmModeFreeResources(res);
-	return 0;
+	return job;
 }
 
-/*************************   Public API   ****************************/
-
-void platsch_draw(struct platsch_ctx *ctx)
+/*
+ * Returns the connectors in probing order as soon as they are probed, NULL
+ * once all are handed out. Each probe may take the timeout of the job; when a
+ * probe hangs for longer, the connectors after it are given up and NULL is
+ * returned as well.
+ */
+static drmModeConnector *probe_next(struct probe_job *job)
 {
-	struct modeset_dev *iter;
-	int ret;
+	drmModeConnector *conn = NULL;
+	struct timespec deadline;
 
-	for (iter = ctx->modeset_list; iter; iter = iter->next) {
+	pthread_mutex_lock(&job->lock);
 
-		/* draw first then set the mode */
-		if (ctx->custom_draw_buffer_cb)
-			platsch_custom_draw_buffer(ctx, iter);
-		else
-			platsch_draw_buffer(ctx, iter);
+	/* the connectors handed out before are set up and committed */
+	if (job->paced && job->released < job->next) {
+		job->released = job->next;
+		clock_gettime(CLOCK_MONOTONIC, &job->started);
+		pthread_cond_broadcast(&job->cond);
+	}
 
-		if (iter->setmode) {
-			debug("set crtc\n");
+	while (!conn && job->next < job->count) {
+		if (job->next < job->done) {
+			conn = job->conns[job->next];
+			job->conns[job->next++] = NULL;
+			continue;
+		}
 
-			ret = drmModeSetCrtc(ctx->drmfd, iter->crtc_id, iter->fb_id,
-					     0, 0, &iter->conn_id, 1, &iter->mode);
-			if (ret)
-				error("Cannot set CRTC for connector #%u: %m\n",
-				      iter->conn_id);
-			else
-				iter->setmode = 0;
-		} else {
-			debug("page flip\n");
-			ret = drmModePageFlip(ctx->drmfd, iter->crtc_id, iter->fb_id,
-					      0, NULL);
-			if (ret)
-				error("Page flip failed on connector #%u: %m\n",
-				      iter->conn_id);
+		if (!job->timeout_ms) {
+			pthread_cond_wait(&job->cond, &job->lock);
+			continue;
+		}
+
+		deadline = job->started;
+		deadline.tv_sec += job->timeout_ms / 1000;
+		deadline.tv_nsec += (job->timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		if (pthread_cond_timedwait(&job->cond, &job->lock, &deadline) ==
+		    ETIMEDOUT && job->next == job->done) {
+			error("Probing connector #%u timed out, ignoring it and all after it\n",
+			      job->conn_ids[job->done]);
+			job->abandoned = true;
+			job->hung = true;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&job->lock);
+
+	return conn;
 }
 
-void platsch_register_custom_draw_cb(struct platsch_ctx *ctx, custom_draw_cb cb,
-				     void *priv)
+/*
+ * Wait for the worker unless it hangs in a probe, a process forking later on
+ * must not have any other thread running. A hanging one sits in the ioctl,
+ * not holding any locks of the C library.
+ */
+static void probe_finish(struct probe_job *job)
 {
-	if (!ctx)
-		return;
+	pthread_mutex_lock(&job->lock);
+	job->abandoned = true;
+	pthread_cond_broadcast(&job->cond);
+
+	if (job->threaded && !job->hung) {
+		pthread_mutex_unlock(&job->lock);
+		pthread_join(job->thread, NULL);
+		pthread_mutex_lock(&job->lock);
+	} else if (job->threaded) {
+		pthread_detach(job->thread);
+	}
 
-	ctx->custom_draw_buffer_cb = cb;
-	ctx->custom_draw_priv = priv;
+	probe_job_put(job);
 }
 
-struct platsch_ctx *platsch_create_ctx(const char *dir, const char *base)
+/*
+ * The topology cache has a line per output:
+ *
+ * <card> <connector id> <crtc id> <mode env> <fbsize env> <format> <fb size>
+ * <mode timings as in drmModeModeInfo>
+ *
+ * The environment settings of the connector are recorded to notice changes,
+ * "-" stands for unset.
+ */
+#define CACHE_FORMAT "%s %u %u %s %s %s %ux%u " \
+		     "%u %hu %hu %hu %hu %hu %hu %hu %hu %hu %hu %u %u %u %s\n"
+
+static bool cache_env_matches(drmModeConnector *conn, const char *setting,
+			      const char *cached)
 {
-	struct platsch_ctx *ctx;
-	int ret;
+	char *name = get_env_connector_name(conn, setting);
+	const char *value;
+	bool match;
 
-	ctx = platsch_alloc_ctx(dir, base);
-	if (!ctx)
-		return NULL;
+	if (!name)
+		return false;
 
-	ret = platsch_init_ctx(ctx);
-	if (ret) {
-		platsch_destroy_ctx(ctx);
-		return NULL;
-	}
+	value = getenv(name) ?: "-";
+	match = !strcmp(value, cached);
+	free(name);
 
-	return ctx;
+	return match;
 }
 
-struct platsch_ctx *platsch_alloc_ctx(const char *dir, const char *base)
+static struct modeset_dev *drmprepare_cached_dev(struct platsch_card *card,
+						 drmModeRes *res,
+						 const char *line)
 {
-	struct platsch_ctx *ctx;
-	int drmfd;
-	int ret;
+	char path[256], mode_env[64], fbsize_env[64], format[16];
+	drmModeConnector *conn = NULL;
+	struct modeset_dev *dev;
+	drmModeModeInfo *m;
+	drmModeEncoder *enc;
 	int i;
 
-	ctx = calloc(1, sizeof(*ctx));
-	if (!ctx) {
-		error("Cannot allocate memory for platsch_ctx\n");
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
 		return NULL;
+	m = &dev->mode;
+
+	if (sscanf(line, "%255s %u %u %63s %63s %15s %ux%u %u %hu %hu %hu %hu %hu "
+		   "%hu %hu %hu %hu %hu %u %u %u %31s",
+		   path, &dev->conn_id, &dev->crtc_id, mode_env, fbsize_env,
+		   format, &dev->width, &dev->height, &m->clock, &m->hdisplay,
+		   &m->hsync_start, &m->hsync_end, &m->htotal, &m->hskew,
+		   &m->vdisplay, &m->vsync_start, &m->vsync_end, &m->vtotal,
+		   &m->vscan, &m->vrefresh, &m->flags, &m->type, m->name) != 23 ||
+	    strcmp(path, card->path))
+		goto err;
+
+	if (!strcmp(m->name, "-"))
+		m->name[0] = '\0';
+
+	dev->format = platsch_format_find(format);
+	if (!dev->format)
+		goto err;
+
+	for (i = 0; i < res->count_crtcs; i++)
+		if (res->crtcs[i] == dev->crtc_id)
+			break;
+	if (i == res->count_crtcs)
+		goto err;
+	dev->crtc_idx = i;
+
+	/* the cached state of the connector is good enough, no probing */
+	conn = drmModeGetConnectorCurrent(card->drmfd, dev->conn_id);
+	if (!conn || conn->connection == DRM_MODE_DISCONNECTED ||
+	    !connector_allowed(card->ctx->connectors, conn) ||
+	    !cache_env_matches(conn, "mode", mode_env) ||
+	    !cache_env_matches(conn, "fbsize", fbsize_env))
+		goto err;
+	dev->internal = connector_is_internal(conn);
+
+	/* keep the mode if the connector shows it already */
+	dev->setmode = 1;
+	if (conn->encoder_id) {
+		enc = drmModeGetEncoder(card->drmfd, conn->encoder_id);
+		if (enc && enc->crtc_id == dev->crtc_id)
+			dev->setmode = 0;
+		drmModeFreeEncoder(enc);
 	}
+	drmModeFreeConnector(conn);
 
-	if (!dir)
-		dir = "/usr/share/platsch";
-	ctx->dir = strdup(dir);
+	if (drmprepare_plane(card, dev) || modeset_create_fb(card, dev))
+		goto err;
 
-	if (!base)
-		base = "splash";
-	ctx->base = strdup(base);
+	if (modeset_atomic_commit(card, dev, DRM_MODE_ATOMIC_TEST_ONLY)) {
+		modeset_destroy_fb(card, dev);
+		goto err;
+	}
 
-	for (i = 0; i < 64; i++) {
-		struct drm_mode_card_res res = {0};
-		char *drmdev;
+	return dev;
 
-		/*
-		 * XXX: Maybe use drmOpen instead?
-		 * (Where should name/busid come from?)
-		 * XXX: Loop through drm devices to find one with connectors.
-		 */
-		ret = asprintf(&drmdev, DRM_DEV_NAME, DRM_DIR_NAME, i);
-		if (ret < 0) {
-			error("Huh, failed to allocate device name buffer\n");
-			goto err_out;
-		}
+err:
+	drmModeFreeConnector(conn);
+	free(dev);
 
-		drmfd = open(drmdev, O_RDWR | O_CLOEXEC, 0);
-		free(drmdev);
-		if (drmfd < 0) {
-			error("Failed to open drm device: %m\n");
-			goto err_out;
-		}
+	return NULL;
+}
+
+/*
+ * Set up the outputs recorded in the topology cache, which saves probing the
+ * connectors and searching CRTCs. Every output is checked with a TEST_ONLY
+ * commit, if any of them fails or a connector not in the cache is connected,
+ * nothing is set up.
+ */
+static int drmprepare_cached(struct platsch_card *card, drmModeRes *res)
+{
+	const char *line, *data = card->ctx->cache_data;
+	struct modeset_dev *dev, **last = &card->modeset_list;
+	drmModeConnector *conn;
+	int i, len = strlen(card->path);
+
+	if (!data || !card->atomic)
+		return -ENOENT;
 
-		ret = drmIoctl(drmfd, DRM_IOCTL_MODE_GETRESOURCES, &res);
-		if (ret < 0) {
-			close(drmfd);
+	for (line = data; *line; line = strchrnul(line, '\n'), line += !!*line) {
+		if (strncmp(line, card->path, len) || line[len] != ' ')
 			continue;
-		} else {
-			/* Device found */
-			ctx->drmfd = drmfd;
-			break;
+
+		dev = drmprepare_cached_dev(card, res, line);
+		if (!dev)
+			goto err;
+
+		*last = dev;
+		last = &dev->next;
+	}
+
+	if (!card->modeset_list)
+		return -ENOENT;
+
+	/* a newly connected display needs the full setup */
+	for (i = 0; i < res->count_connectors; i++) {
+		for (dev = card->modeset_list; dev; dev = dev->next)
+			if (dev->conn_id == res->connectors[i])
+				break;
+		if (dev)
+			continue;
+
+		conn = drmModeGetConnectorCurrent(card->drmfd,
+						  res->connectors[i]);
+		if (conn && conn->connection == DRM_MODE_CONNECTED &&
+		    connector_allowed(card->ctx->connectors, conn)) {
+			drmModeFreeConnector(conn);
+			goto err;
 		}
+		drmModeFreeConnector(conn);
 	}
 
-	return ctx;
+	debug("using cached topology for %s\n", card->path);
 
-err_out:
-	free(ctx->dir);
-	free(ctx->base);
-	free(ctx);
+	return 0;
 
-	return NULL;
+err:
+	debug("cached topology for %s is stale\n", card->path);
+
+	while ((dev = card->modeset_list)) {
+		card->modeset_list = dev->next;
+		modeset_destroy_fb(card, dev);
+		free(dev);
+	}
+
+	return -ESTALE;
 }
 
-int platsch_init_ctx(struct platsch_ctx *ctx)
+int platsch_write_cache(struct platsch_ctx *ctx)
 {
-	return drmprepare(ctx);
+	char *data = NULL, *mode_env, *fbsize_env, *tmp;
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+	drmModeConnector *conn;
+	drmModeModeInfo *m;
+	size_t size;
+	int fd, ret = -ENOMEM;
+	FILE *f;
+
+	if (!ctx->cache_path)
+		return 0;
+
+	f = open_memstream(&data, &size);
+	if (!f)
+		return -ENOMEM;
+
+	for (card = ctx->cards; card; card = card->next) {
+		for (dev = card->modeset_list; dev; dev = dev->next) {
+			if (dev->disconnected || !dev->crtc_id)
+				continue;
+
+			conn = drmModeGetConnectorCurrent(card->drmfd,
+							  dev->conn_id);
+			if (!conn)
+				continue;
+			mode_env = get_env_connector_name(conn, "mode");
+			fbsize_env = get_env_connector_name(conn, "fbsize");
+			drmModeFreeConnector(conn);
+
+			/* an empty name would end the line early for sscanf */
+			m = &dev->mode;
+			if (mode_env && fbsize_env)
+				fprintf(f, CACHE_FORMAT, card->path, dev->conn_id,
+					dev->crtc_id, getenv(mode_env) ?: "-",
+					getenv(fbsize_env) ?: "-",
+					dev->format->name, dev->width,
+					dev->height, m->clock, m->hdisplay,
+					m->hsync_start, m->hsync_end, m->htotal,
+					m->hskew, m->vdisplay, m->vsync_start,
+					m->vsync_end, m->vtotal, m->vscan,
+					m->vrefresh, m->flags, m->type,
+					m->name[0] && !strpbrk(m->name, " \t\n") ?
+					m->name : "-");
+
+			free(mode_env);
+			free(fbsize_env);
+		}
+	}
+
+	if (fclose(f))
+		goto out;
+
+	/* don't wear out the storage writing the same on every boot */
+	ret = 0;
+	if (ctx->cache_data && !strcmp(data, ctx->cache_data))
+		goto out;
+
+	ret = -ENOMEM;
+	if (asprintf(&tmp, "%s.tmp", ctx->cache_path) < 0)
+		goto out;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		error("Cannot write topology cache %s: %m\n", tmp);
+		free(tmp);
+		goto out;
+	}
+
+	/* a short write doesn't set errno */
+	ret = 0;
+	errno = 0;
+	if (write(fd, data, size) != (ssize_t)size || fsync(fd) ||
+	    rename(tmp, ctx->cache_path)) {
+		ret = errno ? -errno : -EIO;
+		error("Cannot write topology cache %s: %m\n", ctx->cache_path);
+	}
+
+	close(fd);
+	unlink(tmp);
+	free(tmp);
+
+	/* remember what is written, a failed write is tried again */
+	if (!ret) {
+		free(ctx->cache_data);
+		ctx->cache_data = data;
+		data = NULL;
+	}
+out:
+	free(data);
+
+	return ret;
 }
 
-void platsch_destroy_ctx(struct platsch_ctx *ctx)
+/* set up an output for conn unless it's excluded or not connected */
+static struct modeset_dev *drmprepare_one(struct platsch_card *card,
+					  drmModeRes *res,
+					  drmModeConnector *conn)
 {
-	struct modeset_dev *mode, *next;
+	struct modeset_dev *dev;
 	int ret;
 
-	if (drmIsMaster(ctx->drmfd)) {
-		ret = drmDropMaster(ctx->drmfd);
-		if (ret)
-			error("Failed to drop master on drm device\n");
+	debug("Connector #%u has type %s\n", conn->connector_id,
+	      drmModeGetConnectorTypeName(conn->connector_type));
+
+	if (!connector_allowed(card->ctx->connectors, conn)) {
+		debug("Connector #%u is excluded\n", conn->connector_id);
+		return NULL;
+	}
+
+	/* create a device structure */
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		error("Cannot allocate memory for connector #%u: %m\n",
+		      conn->connector_id);
+		return NULL;
+	}
+	dev->conn_id = conn->connector_id;
+
+	ret = drmprepare_connector(card, res, conn, dev);
+	if (ret) {
+		if (ret != -ENOENT) {
+			error("Cannot setup device for connector #%u: %m\n",
+			      conn->connector_id);
+		}
+		free(dev);
+		return NULL;
 	}
 
-	for (mode = ctx->modeset_list; mode;) {
-		next = mode->next;
-		free(mode);
-		mode = next;
+	return dev;
+}
+
+static int drmprepare(struct platsch_card *card)
+{
+	drmModeRes *res;
+	drmModeConnector *conn;
+	struct modeset_dev *dev, **last;
+	struct probe_job *job;
+	struct timespec start;
+
+	/* atomic is only used for plane scaling, so failing here is fine */
+	card->atomic = !drmSetClientCap(card->drmfd, DRM_CLIENT_CAP_ATOMIC, 1);
+
+	/* retrieve resources unless that already happened while probing */
+	res = card->res ?: drmModeGetResources(card->drmfd);
+	card->res = NULL;
+	if (!res) {
+		error("cannot retrieve DRM resources: %m\n");
+		return -errno;
+	}
+
+	if (!drmprepare_cached(card, res)) {
+		drmModeFreeResources(res);
+		for (dev = card->modeset_list; card->pipelined && dev;
+		     dev = dev->next)
+			platsch_show_dev(card, dev);
+		return 0;
+	}
+
+	debug("Found %d connectors\n", res->count_connectors);
+
+	job = probe_start(card, res);
+	if (!job) {
+		drmModeFreeResources(res);
+		return -ENOMEM;
+	}
+
+	for (last = &card->modeset_list; *last; last = &(*last)->next)
+		;
+
+	/*
+	 * The connectors come in probing order, built-in panels first: they get
+	 * the first pick of the CRTCs and show the splash first, so they decide
+	 * the perceived boot time. When pipelined, an output is shown before
+	 * the next connector is probed (see struct probe_job), so its commit
+	 * doesn't wait for the modeset locks held during a probe.
+	 */
+	while ((conn = probe_next(job))) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		dev = drmprepare_one(card, res, conn);
+		drmModeFreeConnector(conn);
+		if (!dev)
+			continue;
+
+		if (card->ctx->timings)
+			debug("connector #%u set up in %u us\n", dev->conn_id,
+			      elapsed_us(&start));
+
+		*last = dev;
+		last = &dev->next;
+
+		if (card->pipelined)
+			platsch_show_dev(card, dev);
+	}
+
+	probe_finish(job);
+
+	/* free resources again */
+	drmModeFreeResources(res);
+	return 0;
+}
+
+static int modeset_wait_vblank(struct platsch_card *card, struct modeset_dev *dev)
+{
+	drmVBlank vbl = {
+		.request = {
+			.type = DRM_VBLANK_RELATIVE |
+				((dev->crtc_idx << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				 DRM_VBLANK_HIGH_CRTC_MASK),
+			.sequence = 1,
+		},
+	};
+
+	return drmWaitVBlank(card->drmfd, &vbl);
+}
+
+static int read_uint(const char *path, uint32_t *value)
+{
+	char buf[16];
+	ssize_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	size = readfull(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (size <= 0)
+		return -EIO;
+	buf[size] = '\0';
+	*value = strtoul(buf, NULL, 10);
+
+	return 0;
+}
+
+/*
+ * Use the first backlight device, there is usually only one and it belongs to
+ * the built-in panel.
+ */
+static int fadeprepare_backlight(struct platsch_ctx *ctx)
+{
+	struct dirent *entry;
+	uint32_t max;
+	char *path;
+	DIR *dir;
+	int ret;
+
+	if (ctx->backlight_fd >= 0)
+		return 0;
+
+	dir = opendir("/sys/class/backlight");
+	if (!dir)
+		return -errno;
+
+	do {
+		entry = readdir(dir);
+	} while (entry && entry->d_name[0] == '.');
+
+	if (!entry) {
+		closedir(dir);
+		return -ENOENT;
+	}
+
+	ret = asprintf(&path, "/sys/class/backlight/%s/max_brightness",
+		       entry->d_name);
+	closedir(dir);
+	if (ret < 0)
+		return -ENOMEM;
+
+	ret = read_uint(path, &max);
+	if (ret)
+		goto out;
+
+	/*
+	 * Fade to the brightness set by the bootloader or a previous user. If
+	 * the backlight is off, that's the fading in.
+	 */
+	strcpy(strrchr(path, '/'), "/brightness");
+	ret = read_uint(path, &ctx->backlight_full);
+	if (ret)
+		goto out;
+	if (!ctx->backlight_full || ctx->backlight_full > max)
+		ctx->backlight_full = max;
+
+	ctx->backlight_fd = open(path, O_WRONLY | O_CLOEXEC);
+	ret = ctx->backlight_fd < 0 ? -errno : 0;
+
+	debug("using backlight %s with brightness %u\n",
+	      path, ctx->backlight_full);
+out:
+	free(path);
+
+	return ret;
+}
+
+/*
+ * Find the cheapest way to fade a connector without touching its pixels, in
+ * that order: the crtc's gamma LUT, the plane's alpha or the backlight.
+ */
+static void fadeprepare(struct platsch_ctx *ctx, struct platsch_card *card,
+			struct modeset_dev *dev)
+{
+	drmModeCrtc *crtc;
+	uint64_t size;
+
+	if (card->atomic) {
+		dev->gamma_lut_prop = drm_get_prop_id(card->drmfd, dev->crtc_id,
+						      DRM_MODE_OBJECT_CRTC,
+						      "GAMMA_LUT");
+		if (dev->gamma_lut_prop &&
+		    !drm_get_prop_value(card->drmfd, dev->crtc_id,
+					DRM_MODE_OBJECT_CRTC, "GAMMA_LUT_SIZE",
+					&size) && size > 1) {
+			dev->gamma_size = size;
+			dev->fade_method = PLATSCH_FADE_GAMMA_LUT;
+			goto out;
+		}
+
+		if (dev->plane_id || !drmprepare_plane(card, dev))
+			dev->alpha_prop = drm_get_prop_id(card->drmfd,
+							  dev->plane_id,
+							  DRM_MODE_OBJECT_PLANE,
+							  "alpha");
+		if (dev->alpha_prop) {
+			dev->fade_method = PLATSCH_FADE_ALPHA;
+			goto out;
+		}
+	} else {
+		crtc = drmModeGetCrtc(card->drmfd, dev->crtc_id);
+		if (crtc && crtc->gamma_size > 1) {
+			dev->gamma_size = crtc->gamma_size;
+			dev->fade_method = PLATSCH_FADE_LEGACY_GAMMA;
+		}
+		drmModeFreeCrtc(crtc);
+		if (dev->fade_method)
+			goto out;
+	}
+
+	if (dev->internal && !fadeprepare_backlight(ctx)) {
+		dev->fade_method = PLATSCH_FADE_BACKLIGHT;
+		goto out;
+	}
+
+	error("No way to fade connector #%u\n", dev->conn_id);
+	dev->fade_method = PLATSCH_FADE_NONE;
+	return;
+
+out:
+	debug("fading connector #%u using method %d\n", dev->conn_id,
+	      dev->fade_method);
+}
+
+static uint16_t fade_gamma(uint32_t i, uint32_t size, uint16_t level)
+{
+	return (uint64_t)i * PLATSCH_LEVEL_MAX / (size - 1) * level /
+	       PLATSCH_LEVEL_MAX;
+}
+
+static int fade_gamma_lut(struct platsch_card *card, struct modeset_dev *dev,
+			  drmModeAtomicReq *req, uint16_t level)
+{
+	struct drm_color_lut *lut;
+	uint32_t i;
+	int ret;
+
+	/* no LUT at all is a linear ramp without any rounding errors */
+	dev->gamma_blob = 0;
+	if (level < PLATSCH_LEVEL_MAX) {
+		lut = calloc(dev->gamma_size, sizeof(*lut));
+		if (!lut)
+			return -ENOMEM;
+
+		for (i = 0; i < dev->gamma_size; i++) {
+			lut[i].red = fade_gamma(i, dev->gamma_size, level);
+			lut[i].green = lut[i].red;
+			lut[i].blue = lut[i].red;
+		}
+
+		ret = drmModeCreatePropertyBlob(card->drmfd, lut,
+						dev->gamma_size * sizeof(*lut),
+						&dev->gamma_blob);
+		free(lut);
+		if (ret)
+			return -errno;
+	}
+
+	ret = drmModeAtomicAddProperty(req, dev->crtc_id, dev->gamma_lut_prop,
+				       dev->gamma_blob);
+
+	return ret < 0 ? ret : 0;
+}
+
+static int fade_legacy_gamma(struct platsch_card *card, struct modeset_dev *dev,
+			     uint16_t level)
+{
+	uint16_t *ramp;
+	uint32_t i;
+	int ret;
+
+	ramp = calloc(dev->gamma_size, sizeof(*ramp));
+	if (!ramp)
+		return -ENOMEM;
+
+	for (i = 0; i < dev->gamma_size; i++)
+		ramp[i] = fade_gamma(i, dev->gamma_size, level);
+
+	ret = drmModeCrtcSetGamma(card->drmfd, dev->crtc_id, dev->gamma_size,
+				  ramp, ramp, ramp);
+	free(ramp);
+
+	return ret ? -errno : 0;
+}
+
+static int fade_backlight(struct platsch_ctx *ctx, uint16_t level)
+{
+	char buf[16];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%u\n",
+		       (uint32_t)((uint64_t)ctx->backlight_full * level /
+				  PLATSCH_LEVEL_MAX));
+
+	if (pwrite(ctx->backlight_fd, buf, len, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* apply a brightness level to all connectors of a card */
+static int fade_step_card(struct platsch_card *card, uint16_t level, bool sync,
+			  bool *backlight)
+{
+	drmModeAtomicReq *req = NULL;
+	struct modeset_dev *iter;
+	int ret = 0;
+
+	for (iter = card->modeset_list; iter && !ret; iter = iter->next) {
+		if (iter->disconnected)
+			continue;
+
+		if (iter->fade_method == PLATSCH_FADE_UNPREPARED)
+			fadeprepare(card->ctx, card, iter);
+
+		switch (iter->fade_method) {
+		case PLATSCH_FADE_GAMMA_LUT:
+		case PLATSCH_FADE_ALPHA:
+			if (!req)
+				req = drmModeAtomicAlloc();
+			if (!req) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			if (iter->fade_method == PLATSCH_FADE_GAMMA_LUT)
+				ret = fade_gamma_lut(card, iter, req, level);
+			else if (drmModeAtomicAddProperty(req, iter->plane_id,
+							  iter->alpha_prop,
+							  level) < 0)
+				ret = -ENOMEM;
+			break;
+		case PLATSCH_FADE_LEGACY_GAMMA:
+			ret = fade_legacy_gamma(card, iter, level);
+			break;
+		case PLATSCH_FADE_BACKLIGHT:
+			*backlight = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* a blocking commit returns after the vblank it was applied in */
+	if (req && !ret) {
+		ret = drmModeAtomicCommit(card->drmfd, req, 0, NULL);
+		if (ret)
+			ret = -errno;
+	} else if (sync && card->modeset_list && !ret) {
+		ret = modeset_wait_vblank(card, card->modeset_list);
+	}
+
+	drmModeAtomicFree(req);
+
+	for (iter = card->modeset_list; iter; iter = iter->next) {
+		if (iter->gamma_blob) {
+			drmModeDestroyPropertyBlob(card->drmfd, iter->gamma_blob);
+			iter->gamma_blob = 0;
+		}
+	}
+
+	return ret;
+}
+
+/* apply a brightness level to all connectors, optionally synchronized to vblank */
+static int fade_step(struct platsch_ctx *ctx, uint16_t level, bool sync)
+{
+	struct platsch_card *card;
+	bool backlight = false;
+	int ret = 0;
+
+	/* only wait for the vblank of the first card, they are not in sync anyhow */
+	for (card = ctx->cards; card && !ret; card = card->next) {
+		ret = fade_step_card(card, level, sync, &backlight);
+		sync = false;
+	}
+
+	if (backlight && !ret)
+		ret = fade_backlight(ctx, level);
+
+	if (ret)
+		error("Failed to set brightness level %u: %s\n", level,
+		      strerror(-ret));
+	else
+		ctx->level = level;
+
+	return ret;
+}
+
+static void platsch_draw_dev(struct platsch_ctx *ctx, struct modeset_dev *dev)
+{
+	free(dev->msg_bg);
+	dev->msg_bg = NULL;
+
+	if (dev->loaded)
+		dev->loaded = false;
+	else if (ctx->custom_draw_buffer_cb)
+		platsch_custom_draw_buffer(ctx, dev);
+	else
+		platsch_draw_buffer(ctx, dev);
+
+	dev->clean = false;
+}
+
+static void platsch_event_handler(int fd, unsigned int sequence,
+				  unsigned int tv_sec, unsigned int tv_usec,
+				  void *user_data)
+{
+	struct platsch_event *event = user_data;
+
+	(void)fd;
+	(void)sequence;
+	(void)tv_sec;
+	(void)tv_usec;
+
+	if (event && event->handler)
+		event->handler(event);
+}
+
+static drmEventContext platsch_evctx = {
+	.version = 2,
+	.vblank_handler = platsch_event_handler,
+	.page_flip_handler = platsch_event_handler,
+};
+
+struct page_flip_wait {
+	struct platsch_event event;
+	bool pending;
+};
+
+static void page_flip_wait_handler(struct platsch_event *event)
+{
+	struct page_flip_wait *wait = (struct page_flip_wait *)event;
+
+	wait->pending = false;
+}
+
+static int modeset_page_flip_wait(struct platsch_card *card,
+				  struct modeset_dev *dev, uint32_t fb_id)
+{
+	struct page_flip_wait wait = {
+		.event.handler = page_flip_wait_handler,
+		.pending = true,
+	};
+	struct pollfd pfd = {
+		.fd = card->drmfd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	ret = drmModePageFlip(card->drmfd, dev->crtc_id, fb_id,
+			      DRM_MODE_PAGE_FLIP_EVENT, &wait);
+	if (ret)
+		return -errno;
+
+	while (wait.pending) {
+		ret = poll(&pfd, 1, 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? -errno : -ETIMEDOUT;
+
+		ret = drmHandleEvent(card->drmfd, &platsch_evctx);
+		if (ret)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the framebuffer currently scanned out on the crtc of dev into a
+ * (cached) buffer with the layout of dev. Returns NULL if there is none or it
+ * doesn't match the size and format of dev.
+ */
+static void *modeset_read_current_fb(struct platsch_card *card,
+				     struct modeset_dev *dev)
+{
+	struct drm_mode_map_dumb mreq;
+	drmModeFB2 *fb = NULL;
+	drmModeCrtc *crtc;
+	void *map = MAP_FAILED, *buf = NULL;
+	size_t size = 0;
+	uint32_t format, y;
+	int prime_fd = -1;
+
+	crtc = drmModeGetCrtc(card->drmfd, dev->crtc_id);
+	if (!crtc)
+		return NULL;
+
+	/* nothing to do if our own framebuffer is on screen already */
+	if (crtc->buffer_id && crtc->buffer_id != dev->fb_id)
+		fb = drmModeGetFB2(card->drmfd, crtc->buffer_id);
+	drmModeFreeCrtc(crtc);
+	if (!fb)
+		return NULL;
+
+	/* the alpha channel of the old image is irrelevant for scanout */
+	format = fb->pixel_format == DRM_FORMAT_ARGB8888 ?
+		 DRM_FORMAT_XRGB8888 : fb->pixel_format;
+
+	if (!fb->handles[0] || fb->width != dev->width ||
+	    fb->height != dev->height || format != dev->format->format ||
+	    ((fb->flags & DRM_MODE_FB_MODIFIERS) && fb->modifier)) {
+		debug("cannot crossfade from fb #%u on crtc #%u\n",
+		      fb->fb_id, dev->crtc_id);
+		goto out;
+	}
+
+	size = (size_t)fb->pitches[0] * fb->height + fb->offsets[0];
+
+	/* dumb buffers can be mapped directly, everything else via PRIME */
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.handle = fb->handles[0];
+	if (!drmIoctl(card->drmfd, DRM_IOCTL_MODE_MAP_DUMB, &mreq))
+		map = mmap(0, size, PROT_READ, MAP_SHARED, card->drmfd,
+			   mreq.offset);
+
+	if (map == MAP_FAILED &&
+	    !drmPrimeHandleToFD(card->drmfd, fb->handles[0], DRM_CLOEXEC,
+				&prime_fd))
+		map = mmap(0, size, PROT_READ, MAP_SHARED, prime_fd, 0);
+
+	if (map == MAP_FAILED) {
+		error("Cannot map fb #%u: %m\n", fb->fb_id);
+		goto out;
+	}
+
+	buf = malloc(dev->size);
+	if (!buf)
+		goto out;
+
+	for (y = 0; y < dev->height; y++)
+		memcpy(buf + y * dev->stride,
+		       map + fb->offsets[0] + y * fb->pitches[0],
+		       dev->width * dev->format->bpp / 8);
+
+out:
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (prime_fd >= 0)
+		close(prime_fd);
+	if (fb->handles[0])
+		drmCloseBufferHandle(card->drmfd, fb->handles[0]);
+	drmModeFreeFB2(fb);
+
+	return buf;
+}
+
+typedef uint8_t v8u8 __attribute__((vector_size(8)));
+typedef uint16_t v8u16 __attribute__((vector_size(16)));
+
+/*
+ * Blend a and b into dst with a weight of alpha/256 for b. The kernels work
+ * on vectors of eight 16 bit lanes which map to NEON or SSE2, so a full frame
+ * blend is cheap enough to run once per vblank.
+ */
+static void blend_xrgb8888(void *dst, const void *a, const void *b, size_t len,
+			   uint16_t alpha)
+{
+	v8u16 va, vb;
+	v8u8 v;
+	size_t i;
+
+	for (i = 0; i + sizeof(v) <= len; i += sizeof(v)) {
+		memcpy(&v, a + i, sizeof(v));
+		va = __builtin_convertvector(v, v8u16);
+		memcpy(&v, b + i, sizeof(v));
+		vb = __builtin_convertvector(v, v8u16);
+
+		va = (va * (uint16_t)(256 - alpha) + vb * alpha) >> 8;
+
+		v = __builtin_convertvector(va, v8u8);
+		memcpy(dst + i, &v, sizeof(v));
+	}
+
+	for (; i < len; i++)
+		((uint8_t *)dst)[i] = (((const uint8_t *)a)[i] * (256 - alpha) +
+				       ((const uint8_t *)b)[i] * alpha) >> 8;
+}
+
+static void blend_rgb565(void *dst, const void *a, const void *b, size_t len,
+			 uint16_t alpha)
+{
+	v8u16 va, vb, r, g, bl;
+	uint16_t pa, pb;
+	size_t i;
+
+	for (i = 0; i + sizeof(va) <= len; i += sizeof(va)) {
+		memcpy(&va, a + i, sizeof(va));
+		memcpy(&vb, b + i, sizeof(vb));
+
+		/* no channel exceeds 6 bits, so the products fit 16 bits */
+		r = ((va >> 11) * (uint16_t)(256 - alpha) +
+		     (vb >> 11) * alpha) >> 8;
+		g = (((va >> 5) & 0x3f) * (uint16_t)(256 - alpha) +
+		     ((vb >> 5) & 0x3f) * alpha) >> 8;
+		bl = ((va & 0x1f) * (uint16_t)(256 - alpha) +
+		      (vb & 0x1f) * alpha) >> 8;
+
+		va = r << 11 | g << 5 | bl;
+		memcpy(dst + i, &va, sizeof(va));
+	}
+
+	for (; i + 1 < len; i += 2) {
+		memcpy(&pa, a + i, 2);
+		memcpy(&pb, b + i, 2);
+		pa = ((pa >> 11) * (256 - alpha) + (pb >> 11) * alpha) >> 8 << 11 |
+		     (((pa >> 5) & 0x3f) * (256 - alpha) +
+		      ((pb >> 5) & 0x3f) * alpha) >> 8 << 5 |
+		     ((pa & 0x1f) * (256 - alpha) + (pb & 0x1f) * alpha) >> 8;
+		memcpy(dst + i, &pa, 2);
+	}
+}
+
+/*
+ * Blend from the image currently on screen to the new one over
+ * ctx->crossfade_frames vblanks, alternating between the framebuffer of dev and
+ * a temporary back buffer. The last frame is the new image in dev's own
+ * framebuffer. Returns 0 if dev shows the new image afterwards.
+ */
+static int modeset_crossfade(struct platsch_ctx *ctx, struct platsch_card *card,
+			     struct modeset_dev *dev)
+{
+	struct modeset_dev back = *dev;
+	struct modeset_dev *target;
+	void *old, *new = NULL, *map;
+	unsigned int frames = ctx->crossfade_frames, i;
+	int ret;
+
+	/* crossfading needs the same mode, so no modeset */
+	if (dev->setmode || modeset_is_scaled(dev))
+		return -EINVAL;
+
+	old = modeset_read_current_fb(card, dev);
+	if (!old)
+		return -ENOENT;
+
+	new = malloc(dev->size);
+	if (!new) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* render the new image into cached memory, it's read once per frame */
+	map = dev->map;
+	dev->map = new;
+	dev->clean = false;
+	platsch_draw_dev(ctx, dev);
+	dev->map = map;
+
+	/* back shares mode and format with dev, but none of its buffer */
+	back.handle = 0;
+	back.fb_id = 0;
+	back.map = NULL;
+	back.msg_bg = NULL;
+	ret = modeset_create_fb(card, &back);
+	if (ret)
+		goto out;
+
+	debug("crossfading connector #%u over %u frames\n", dev->conn_id,
+	      frames);
+
+	for (i = 1; i <= frames; i++) {
+		target = (frames - i) % 2 ? &back : dev;
+
+		if (i == frames)
+			memcpy(target->map, new, dev->size);
+		else if (dev->format->format == DRM_FORMAT_RGB565)
+			blend_rgb565(target->map, old, new, dev->size,
+				     i * 256 / frames);
+		else
+			blend_xrgb8888(target->map, old, new, dev->size,
+				       i * 256 / frames);
+
+		ret = modeset_page_flip_wait(card, target, target->fb_id);
+		if (ret) {
+			error("Page flip failed on connector #%u: %s\n",
+			      dev->conn_id, strerror(-ret));
+			break;
+		}
+	}
+
+	if (ret) {
+		/* make sure the back buffer isn't on screen before removing it */
+		memcpy(dev->map, new, dev->size);
+		ret = drmModeSetCrtc(card->drmfd, dev->crtc_id, dev->fb_id, 0, 0,
+				     &dev->conn_id, 1, &dev->mode);
+		if (ret)
+			ret = -errno;
+	}
+
+	modeset_destroy_fb(card, &back);
+out:
+	free(new);
+	free(old);
+
+	return ret;
+}
+
+static void platsch_commit_dev(struct platsch_card *card,
+			       struct modeset_dev *dev)
+{
+	int ret;
+
+	if (modeset_is_scaled(dev)) {
+		debug("atomic commit\n");
+
+		ret = modeset_atomic_commit(card, dev, 0);
+		if (ret)
+			error("Atomic commit failed on connector #%u: %s\n",
+			      dev->conn_id, strerror(-ret));
+		else
+			dev->setmode = 0;
+	} else if (dev->setmode) {
+		debug("set crtc\n");
+
+		ret = drmModeSetCrtc(card->drmfd, dev->crtc_id, dev->fb_id,
+				     0, 0, &dev->conn_id, 1, &dev->mode);
+		if (ret)
+			error("Cannot set CRTC for connector #%u: %m\n",
+			      dev->conn_id);
+		else
+			dev->setmode = 0;
+	} else {
+		debug("page flip\n");
+		ret = drmModePageFlip(card->drmfd, dev->crtc_id, dev->fb_id,
+				      0, NULL);
+		if (ret)
+			error("Page flip failed on connector #%u: %m\n",
+			      dev->conn_id);
+	}
+}
+
+static void platsch_show_dev(struct platsch_card *card, struct modeset_dev *dev)
+{
+	struct platsch_ctx *ctx = card->ctx;
+	struct timespec start;
+	unsigned int draw_us;
+
+	/* the mapping might have been released after the last draw */
+	if (modeset_map_fb(card, dev))
+		return;
+
+	if (ctx->crossfade_frames && !modeset_crossfade(ctx, card, dev))
+		return;
+
+	/* draw first then set the mode */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	platsch_draw_dev(ctx, dev);
+	draw_us = elapsed_us(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	platsch_commit_dev(card, dev);
+
+	if (ctx->timings)
+		debug("connector #%u: drawn in %u us, committed in %u us\n",
+		      dev->conn_id, draw_us, elapsed_us(&start));
+}
+
+#ifdef HAVE_LIBURING
+/*
+ * Load the splash images of all outputs of a card with a single io_uring
+ * submission, linking open, read and close of each image. Images that fail to
+ * load are read the usual way by platsch_draw_buffer() later on. This is used
+ * whenever a card is drawn as a whole: platsch_draw() (e.g. when fading in) and
+ * newly added devices. The pipelined setup loads one image at a time.
+ */
+static void platsch_load_images(struct platsch_card *card)
+{
+	struct platsch_ctx *ctx = card->ctx;
+	struct modeset_dev *dev, **devs;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct io_uring ring;
+	struct timespec start;
+	struct iovec *iovs;
+	char **filenames;
+	unsigned int n = 0, i, idx;
+	bool fixed;
+	int ret;
+
+	/* crossfading and custom drawing don't draw into the buffer directly */
+	if (ctx->custom_draw_buffer_cb || ctx->crossfade_frames)
+		return;
+
+	for (dev = card->modeset_list; dev; dev = dev->next)
+		n++;
+
+	devs = calloc(n, sizeof(*devs));
+	iovs = calloc(n, sizeof(*iovs));
+	filenames = calloc(n, sizeof(*filenames));
+	if (!devs || !iovs || !filenames)
+		goto out_free;
+
+	n = 0;
+	for (dev = card->modeset_list; dev; dev = dev->next) {
+		if (dev->disconnected || modeset_map_fb(card, dev))
+			continue;
+
+		filenames[n] = platsch_image_name(ctx, dev);
+		if (!filenames[n])
+			continue;
+
+		iovs[n].iov_base = dev->map;
+		iovs[n].iov_len = dev->size;
+		devs[n++] = dev;
+	}
+
+	if (n < 2 || io_uring_queue_init(3 * n, &ring, 0))
+		goto out_free;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	ret = io_uring_register_files_sparse(&ring, n);
+	if (ret) {
+		debug("Cannot register io_uring files: %s\n", strerror(-ret));
+		goto out_exit;
+	}
+
+	/* not all drivers' buffers can be pinned, reading works nevertheless */
+	fixed = !io_uring_register_buffers(&ring, iovs, n);
+
+	for (i = 0; i < n; i++) {
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_openat_direct(sqe, AT_FDCWD, filenames[i],
+					    ctx->load == PLATSCH_LOAD_DIRECT ?
+					    O_RDONLY | O_DIRECT : O_RDONLY,
+					    0, i);
+		sqe->flags |= IOSQE_IO_LINK;
+		io_uring_sqe_set_data64(sqe, 3 * i);
+
+		sqe = io_uring_get_sqe(&ring);
+		if (fixed)
+			io_uring_prep_read_fixed(sqe, i, iovs[i].iov_base,
+						 iovs[i].iov_len, 0, i);
+		else
+			io_uring_prep_read(sqe, i, iovs[i].iov_base,
+					   iovs[i].iov_len, 0);
+		sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		io_uring_sqe_set_data64(sqe, 3 * i + 1);
+
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_close_direct(sqe, i);
+		io_uring_sqe_set_data64(sqe, 3 * i + 2);
+	}
+
+	ret = io_uring_submit_and_wait(&ring, 3 * n);
+	if (ret < 0) {
+		error("Cannot submit io_uring requests: %s\n", strerror(-ret));
+		goto out_exit;
+	}
+
+	for (i = 0; i < 3 * n; i++) {
+		if (io_uring_wait_cqe(&ring, &cqe))
+			break;
+
+		/* only the reads matter, failing opens cancel them */
+		idx = cqe->user_data / 3;
+		if (cqe->user_data % 3 == 1 && cqe->res > 0) {
+			devs[idx]->loaded = true;
+			if (ctx->load != PLATSCH_LOAD_CACHED)
+				platsch_drop_cache(filenames[idx]);
+			if ((unsigned int)cqe->res < devs[idx]->size) {
+				error("Could only read %d/%u bytes from %s\n",
+				      cqe->res, devs[idx]->size,
+				      filenames[idx]);
+				modeset_clear_tail(devs[idx], cqe->res);
+			}
+		}
+
+		io_uring_cqe_seen(&ring, cqe);
+	}
+
+	if (ctx->timings)
+		debug("loaded %u images in %u us\n", n, elapsed_us(&start));
+
+out_exit:
+	io_uring_queue_exit(&ring);
+out_free:
+	for (i = 0; filenames && i < n; i++)
+		free(filenames[i]);
+	free(filenames);
+	free(iovs);
+	free(devs);
+}
+#else
+static void platsch_load_images(struct platsch_card *card)
+{
+	(void)card;
+}
+#endif
+
+static int platsch_draw_card(struct platsch_card *card)
+{
+	struct modeset_dev *iter;
+
+	platsch_load_images(card);
+
+	for (iter = card->modeset_list; iter; iter = iter->next)
+		if (!iter->disconnected)
+			platsch_show_dev(card, iter);
+
+	return 0;
+}
+
+/* show each output as soon as it is set up */
+static int platsch_prepare_and_draw_card(struct platsch_card *card)
+{
+	int ret;
+
+	card->pipelined = true;
+	ret = drmprepare(card);
+	card->pipelined = false;
+
+	return ret;
+}
+
+static void hotplug_connector(struct platsch_card *card, drmModeRes *res,
+			      uint32_t conn_id)
+{
+	struct modeset_dev *dev;
+	drmModeConnector *conn;
+	int ret;
+
+	conn = drmModeGetConnectorCurrent(card->drmfd, conn_id);
+	if (conn && !connector_allowed(card->ctx->connectors, conn)) {
+		drmModeFreeConnector(conn);
+		return;
+	}
+	drmModeFreeConnector(conn);
+
+	conn = drmModeGetConnector(card->drmfd, conn_id);
+	if (!conn) {
+		error("Cannot retrieve DRM connector #%u: %m\n", conn_id);
+		return;
+	}
+
+	for (dev = card->modeset_list; dev; dev = dev->next)
+		if (dev->conn_id == conn_id && !dev->disconnected)
+			break;
+
+	if (dev) {
+		if (conn->connection != DRM_MODE_CONNECTED) {
+			debug("connector #%u was disconnected\n", conn_id);
+			dev->disconnected = true;
+			dev->crtc_id = 0;
+		}
+		goto out;
+	}
+
+	if (conn->connection != DRM_MODE_CONNECTED)
+		goto out;
+
+	debug("connector #%u was connected\n", conn_id);
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		error("Cannot allocate memory for connector #%u: %m\n", conn_id);
+		goto out;
+	}
+	dev->conn_id = conn_id;
+
+	ret = drmprepare_connector(card, res, conn, dev);
+	if (ret) {
+		error("Cannot setup device for connector #%u: %s\n", conn_id,
+		      strerror(-ret));
+		free(dev);
+		goto out;
+	}
+
+	dev->next = card->modeset_list;
+	card->modeset_list = dev;
+
+	if (!dev->reused)
+		platsch_draw_dev(card->ctx, dev);
+
+	/* whatever the encoder state, a newly connected monitor needs a mode */
+	dev->setmode = 1;
+	platsch_commit_dev(card, dev);
+
+out:
+	drmModeFreeConnector(conn);
+}
+
+static int hotplug_card(struct platsch_card *card, uint32_t conn_id)
+{
+	struct modeset_dev **iter, *dev;
+	drmModeRes *res;
+	int i, ret;
+
+	/* platsch dropped master after drawing, so it must get it back */
+	if (!drmIsMaster(card->drmfd) && drmSetMaster(card->drmfd)) {
+		ret = -errno;
+		error("Cannot become master on %s: %m\n", card->path);
+		return ret;
+	}
+
+	res = drmModeGetResources(card->drmfd);
+	if (!res) {
+		ret = -errno;
+		error("cannot retrieve DRM resources: %m\n");
+		goto out;
+	}
+
+	/* without a connector id all connectors have to be checked */
+	for (i = 0; i < res->count_connectors; i++)
+		if (!conn_id || res->connectors[i] == conn_id)
+			hotplug_connector(card, res, res->connectors[i]);
+
+	drmModeFreeResources(res);
+
+	/* drop devices whose framebuffer was taken over by another one */
+	for (iter = &card->modeset_list; *iter;) {
+		dev = *iter;
+		if (dev->disconnected && !dev->fb_id) {
+			*iter = dev->next;
+			free(dev->msg_bg);
+			free(dev);
+		} else {
+			iter = &dev->next;
+		}
+	}
+
+	ret = 0;
+out:
+	drmDropMaster(card->drmfd);
+
+	return ret;
+}
+
+static void *platsch_card_thread(void *data)
+{
+	struct platsch_card *card = data;
+
+	card->ret = card->fn(card);
+
+	return NULL;
+}
+
+/*
+ * Run fn for all cards. With more than one card each gets its own thread, so
+ * slow probing or modesetting on one display controller doesn't delay the
+ * others. Returns 0 if fn succeeded for at least one card.
+ */
+static int platsch_for_each_card(struct platsch_ctx *ctx, card_fn fn)
+{
+	struct platsch_card *card;
+	bool threaded = ctx->cards && ctx->cards->next;
+	int ret = -ENODEV;
+
+	for (card = ctx->cards; card; card = card->next) {
+		card->fn = fn;
+		card->threaded = threaded &&
+			!pthread_create(&card->thread, NULL,
+					platsch_card_thread, card);
+		if (!card->threaded)
+			platsch_card_thread(card);
+	}
+
+	for (card = ctx->cards; card; card = card->next) {
+		if (card->threaded)
+			pthread_join(card->thread, NULL);
+
+		if (!card->ret)
+			ret = 0;
+		else if (ret)
+			ret = card->ret;
+	}
+
+	return ret;
+}
+
+static struct platsch_ctx *platsch_new_ctx(const char *dir, const char *base)
+{
+	struct platsch_ctx *ctx;
+	const char *env;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		error("Cannot allocate memory for platsch_ctx\n");
+		return NULL;
+	}
+
+	if (!dir)
+		dir = "/usr/share/platsch";
+	ctx->dir = strdup(dir);
+
+	if (!base)
+		base = "splash";
+	ctx->base = strdup(base);
+
+	ctx->level = PLATSCH_LEVEL_MAX;
+	ctx->backlight_fd = -1;
+
+	env = getenv("platsch_crossfade_frames");
+	if (env)
+		ctx->crossfade_frames = strtoul(env, NULL, 10);
+
+	env = getenv("platsch_probe");
+	if (env && !strcmp(env, "current"))
+		ctx->probe_current = true;
+
+	ctx->probe_timeout_ms = 3000;
+	env = getenv("platsch_probe_timeout_ms");
+	if (env)
+		ctx->probe_timeout_ms = strtoul(env, NULL, 10);
+
+	env = getenv("platsch_connectors");
+	if (env && *env)
+		ctx->connectors = strdup(env);
+
+	env = getenv("platsch_timings");
+	if (env && strtoul(env, NULL, 10))
+		ctx->timings = true;
+
+	env = getenv("platsch_load");
+	if (env && !strcmp(env, "drop"))
+		ctx->load = PLATSCH_LOAD_DROP;
+	else if (env && !strcmp(env, "direct"))
+		ctx->load = PLATSCH_LOAD_DIRECT;
+
+	env = getenv("platsch_cache");
+	if (env && *env) {
+		ctx->cache_path = strdup(env);
+		ctx->cache_data = read_file(env);
+	}
+
+	return ctx;
+}
+
+/* res is optional, the card takes ownership of it */
+static int platsch_add_card(struct platsch_ctx *ctx, int drmfd, bool own_fd,
+			    const char *path, drmModeRes *res)
+{
+	struct platsch_card *card, **last;
+
+	card = calloc(1, sizeof(*card));
+	if (!card) {
+		error("Cannot allocate memory for %s\n", path);
+		return -ENOMEM;
+	}
+
+	debug("using %s\n", path);
+	card->ctx = ctx;
+	card->path = strdup(path);
+	card->drmfd = drmfd;
+	card->own_fd = own_fd;
+	card->res = res;
+
+	for (last = &ctx->cards; *last; last = &(*last)->next)
+		;
+	*last = card;
+
+	return 0;
+}
+
+/*
+ * Without udev there are no /dev/dri/by-path links, so construct their names
+ * from sysfs, e.g. "platform-32e00000.lcd-controller" or "pci-0000:00:02.0".
+ * The "-card" suffix of the link is optional.
+ */
+static bool platsch_card_matches_by_path(const char *spec, const char *node)
+{
+	char *sysdev = NULL, *subsystem = NULL, *real_dev, *real_subsystem;
+	const char *name = strrchr(node, '/');
+	char *by_path = NULL;
+	bool match = false;
+
+	if (asprintf(&sysdev, "/sys/class/drm/%s/device",
+		     name ? name + 1 : node) < 0 ||
+	    asprintf(&subsystem, "%s/subsystem", sysdev) < 0)
+		goto out;
+
+	real_dev = realpath(sysdev, NULL);
+	real_subsystem = realpath(subsystem, NULL);
+	if (real_dev && real_subsystem &&
+	    asprintf(&by_path, "%s-%s", basename(real_subsystem),
+		     basename(real_dev)) >= 0) {
+		size_t len = strlen(by_path);
+
+		match = !strcmp(spec, by_path) || !strcmp(spec, basename(real_dev)) ||
+			(!strncmp(spec, by_path, len) && !strcmp(spec + len, "-card"));
+	}
+
+	free(real_dev);
+	free(real_subsystem);
+out:
+	free(by_path);
+	free(subsystem);
+	free(sysdev);
+
+	return match;
+}
+
+/*
+ * A device can be selected by its path (which can be a symlink like
+ * /dev/dri/by-path/...), its by-path name or the name of its driver. The
+ * former two don't need the device to be opened.
+ */
+static bool platsch_card_matches_node(const char *spec, const char *node)
+{
+	char *real_spec, *real_node;
+	bool match;
+
+	if (strchr(spec, '/')) {
+		real_spec = realpath(spec, NULL);
+		real_node = realpath(node, NULL);
+		match = real_spec && real_node && !strcmp(real_spec, real_node);
+		free(real_spec);
+		free(real_node);
+		return match;
+	}
+
+	return platsch_card_matches_by_path(spec, node);
+}
+
+static bool platsch_card_matches_driver(const char *spec, int drmfd)
+{
+	drmVersion *version;
+	bool match;
+
+	version = drmGetVersion(drmfd);
+	if (!version)
+		return false;
+
+	match = !strcmp(spec, version->name);
+	drmFreeVersion(version);
+
+	return match;
+}
+
+static int platsch_open_card(struct platsch_ctx *ctx, const char *node,
+			     const char *spec)
+{
+	bool matched = !spec || platsch_card_matches_node(spec, node);
+	drmModeRes *res;
+	int drmfd, ret;
+
+	/* only a driver name needs the device opened to match it */
+	if (!matched && strchr(spec, '/')) {
+		debug("%s doesn't match %s\n", node, spec);
+		return -ENODEV;
+	}
+
+	drmfd = open(node, O_RDWR | O_CLOEXEC, 0);
+	if (drmfd < 0) {
+		ret = -errno;
+		if (errno != ENOENT)
+			error("Failed to open %s: %m\n", node);
+		return ret;
+	}
+
+	if (!matched && !platsch_card_matches_driver(spec, drmfd)) {
+		debug("%s doesn't match %s\n", node, spec);
+		ret = -ENODEV;
+		goto err_close;
+	}
+
+	/* only use devices that support modesetting */
+	res = drmModeGetResources(drmfd);
+	if (!res) {
+		debug("%s doesn't support modesetting\n", node);
+		ret = -ENODEV;
+		goto err_close;
+	}
+
+	ret = platsch_add_card(ctx, drmfd, true, node, res);
+	if (ret) {
+		drmModeFreeResources(res);
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(drmfd);
+
+	return ret;
+}
+
+static void platsch_open_cards(struct platsch_ctx *ctx, const char *spec)
+{
+	drmDevicePtr *devices;
+	char *node;
+	int count, i;
+
+	if (spec)
+		debug("looking for drm device %s\n", spec);
+
+	/*
+	 * drmGetDevices2() only looks at sysfs, so it is cheap. If sysfs isn't
+	 * mounted (yet), fall back to probing the card nodes.
+	 */
+	count = drmGetDevices2(0, NULL, 0);
+	if (count > 0) {
+		devices = calloc(count, sizeof(*devices));
+		if (devices) {
+			count = drmGetDevices2(0, devices, count);
+			for (i = 0; i < count; i++)
+				if (devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY))
+					platsch_open_card(ctx,
+							  devices[i]->nodes[DRM_NODE_PRIMARY],
+							  spec);
+			drmFreeDevices(devices, count > 0 ? count : 0);
+			free(devices);
+
+			if (count > 0)
+				return;
+		}
+	}
+
+	for (i = 0; i < 64; i++) {
+		if (asprintf(&node, DRM_DEV_NAME, DRM_DIR_NAME, i) < 0)
+			return;
+
+		/* card numbers don't need to be contiguous, so try all */
+		platsch_open_card(ctx, node, spec);
+		free(node);
+	}
+}
+
+static uint32_t modeset_color(struct modeset_dev *dev, uint32_t xrgb)
+{
+	if (dev->format->format == DRM_FORMAT_RGB565)
+		return (xrgb >> 8 & 0xf800) | (xrgb >> 5 & 0x07e0) |
+		       (xrgb >> 3 & 0x001f);
+
+	return xrgb;
+}
+
+static void modeset_fill_rect(struct modeset_dev *dev, uint32_t x, uint32_t y,
+			      uint32_t w, uint32_t h, uint32_t xrgb)
+{
+	uint32_t color = modeset_color(dev, xrgb);
+	uint32_t row, col;
+	void *line;
+
+	if (x >= dev->width || y >= dev->height)
+		return;
+	if (w > dev->width - x)
+		w = dev->width - x;
+	if (h > dev->height - y)
+		h = dev->height - y;
+
+	for (row = y; row < y + h; row++) {
+		line = dev->map + row * dev->stride;
+		for (col = x; col < x + w; col++) {
+			if (dev->format->bpp == 16)
+				((uint16_t *)line)[col] = color;
+			else
+				((uint32_t *)line)[col] = color;
+		}
+	}
+}
+
+static void modeset_draw_progress(struct modeset_dev *dev, unsigned int percent)
+{
+	uint32_t x = dev->width / 4, w = dev->width / 2;
+	uint32_t y = dev->height * 80 / 100, h = dev->height / 108 ?: 2;
+	uint32_t done = w * percent / 100;
+
+	modeset_fill_rect(dev, x, y, done, h, 0xffffff);
+	modeset_fill_rect(dev, x + done, y, w - done, h, 0x404040);
+}
+
+static void modeset_draw_message(struct modeset_dev *dev, const char *message)
+{
+	uint32_t scale = dev->height / 270 ?: 1;
+	uint32_t cell_w = (FONT_WIDTH + 1) * scale;
+	uint32_t cell_h = (FONT_HEIGHT + 1) * scale;
+	uint32_t len = strlen(message), x, y, row, col;
+	const uint8_t *glyph;
+	unsigned char c;
+
+	if (cell_h > dev->height)
+		return;
+
+	y = dev->height * 88 / 100;
+	if (y + cell_h > dev->height)
+		y = dev->height - cell_h;
+
+	/*
+	 * Save the image behind the message line once (reading the mapping is
+	 * slow) and restore it for every message.
+	 */
+	if (!dev->msg_bg) {
+		dev->msg_bg = malloc(cell_h * dev->stride);
+		if (!dev->msg_bg)
+			return;
+		memcpy(dev->msg_bg, dev->map + y * dev->stride,
+		       cell_h * dev->stride);
+	} else {
+		memcpy(dev->map + y * dev->stride, dev->msg_bg,
+		       cell_h * dev->stride);
+	}
+
+	if (len > dev->width / cell_w)
+		len = dev->width / cell_w;
+	x = (dev->width - len * cell_w) / 2;
+
+	for (; len; len--, message++, x += cell_w) {
+		c = toupper((unsigned char)*message);
+		if (c < ' ' || c >= ' ' + ARRAY_SIZE(platsch_font))
+			c = '?';
+		glyph = platsch_font[c - ' '];
+
+		for (row = 0; row < FONT_HEIGHT; row++)
+			for (col = 0; col < FONT_WIDTH; col++)
+				if (glyph[row] & (0x10 >> col))
+					modeset_fill_rect(dev, x + col * scale,
+							  y + row * scale,
+							  scale, scale,
+							  0xffffff);
+	}
+}
+
+static void platsch_frame_handler(struct platsch_event *event)
+{
+	struct platsch_frame *frame = (struct platsch_frame *)event;
+
+	frame->pending = false;
+	frame->card = NULL;
+	frame->cb(frame->priv);
+}
+
+/*************************   Public API   ****************************/
+
+int platsch_request_frame(struct platsch_ctx *ctx, platsch_frame_cb cb,
+			  void *priv)
+{
+	struct platsch_frame *frame = &ctx->frame;
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+	drmVBlank vbl;
+
+	frame->event.handler = platsch_frame_handler;
+	frame->cb = cb;
+	frame->priv = priv;
+
+	/* requests within a frame are coalesced */
+	if (frame->pending)
+		return 0;
+
+	for (card = ctx->cards; card; card = card->next)
+		for (dev = card->modeset_list; dev; dev = dev->next)
+			if (!dev->disconnected)
+				goto found;
+
+	return -ENODEV;
+
+found:
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+			   ((dev->crtc_idx << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+			    DRM_VBLANK_HIGH_CRTC_MASK);
+	vbl.request.sequence = 1;
+	vbl.request.signal = (unsigned long)frame;
+
+	if (drmWaitVBlank(card->drmfd, &vbl))
+		return -errno;
+
+	frame->pending = true;
+	frame->card = card;
+
+	return 0;
+}
+
+int platsch_export_dmabufs(struct platsch_ctx *ctx, platsch_dmabuf_cb cb,
+			   void *priv)
+{
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+	struct platsch_dmabuf buf;
+	int fd, ret, n = 0;
+
+	for (card = ctx->cards; card; card = card->next) {
+		for (dev = card->modeset_list; dev; dev = dev->next) {
+			if (dev->disconnected || !dev->handle)
+				continue;
+
+			ret = drmPrimeHandleToFD(card->drmfd, dev->handle,
+						 DRM_CLOEXEC | DRM_RDWR, &fd);
+			if (ret) {
+				ret = -errno;
+				error("Cannot export buffer of connector #%u: %m\n",
+				      dev->conn_id);
+				return ret;
+			}
+
+			buf.fd = fd;
+			buf.conn_id = dev->conn_id;
+			buf.crtc_id = dev->crtc_id;
+			buf.fb_id = dev->fb_id;
+			buf.width = dev->width;
+			buf.height = dev->height;
+			buf.stride = dev->stride;
+			buf.format = dev->format->format;
+
+			ret = cb(&buf, priv);
+			close(fd);
+			if (ret)
+				return ret;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+void platsch_draw_progress(struct platsch_ctx *ctx, unsigned int percent)
+{
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+
+	if (percent > 100)
+		percent = 100;
+
+	for (card = ctx->cards; card; card = card->next)
+		for (dev = card->modeset_list; dev; dev = dev->next)
+			if (!dev->disconnected && !modeset_map_fb(card, dev))
+				modeset_draw_progress(dev, percent);
+}
+
+void platsch_draw_message(struct platsch_ctx *ctx, const char *message)
+{
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+
+	for (card = ctx->cards; card; card = card->next)
+		for (dev = card->modeset_list; dev; dev = dev->next)
+			if (!dev->disconnected && !modeset_map_fb(card, dev))
+				modeset_draw_message(dev, message);
+}
+
+
+int platsch_set_level(struct platsch_ctx *ctx, uint16_t level)
+{
+	return fade_step(ctx, level, false);
+}
+
+int platsch_fade(struct platsch_ctx *ctx, uint16_t from, uint16_t to,
+		 unsigned int duration_ms)
+{
+	unsigned int vrefresh = 60, frames, i;
+	int ret;
+
+	if (ctx->cards && ctx->cards->modeset_list &&
+	    ctx->cards->modeset_list->mode.vrefresh)
+		vrefresh = ctx->cards->modeset_list->mode.vrefresh;
+
+	frames = duration_ms * vrefresh / 1000;
+	if (!frames)
+		frames = 1;
+
+	for (i = 1; i <= frames; i++) {
+		ret = fade_step(ctx, from + ((int)to - from) * (int)i / (int)frames,
+				true);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int platsch_fade_in(struct platsch_ctx *ctx, unsigned int duration_ms)
+{
+	return platsch_fade(ctx, ctx->level, PLATSCH_LEVEL_MAX, duration_ms);
+}
+
+int platsch_fade_out(struct platsch_ctx *ctx, unsigned int duration_ms)
+{
+	return platsch_fade(ctx, ctx->level, 0, duration_ms);
+}
+
+int platsch_fade_through_black(struct platsch_ctx *ctx,
+			       unsigned int duration_ms)
+{
+	int ret;
+
+	ret = platsch_fade_out(ctx, duration_ms / 2);
+	if (ret)
+		return ret;
+
+	platsch_draw(ctx);
+
+	return platsch_fade_in(ctx, duration_ms - duration_ms / 2);
+}
+
+
+void platsch_draw(struct platsch_ctx *ctx)
+{
+	platsch_for_each_card(ctx, platsch_draw_card);
+}
+
+int platsch_handle_hotplug(struct platsch_ctx *ctx, const char *devname,
+			   uint32_t conn_id)
+{
+	struct platsch_card *card;
+	int ret;
+
+	for (card = ctx->cards; card; card = card->next) {
+		/* devname is relative to /dev, as in uevents */
+		if (devname && (strncmp(card->path, "/dev/", 5) ||
+				strcmp(card->path + 5, devname)))
+			continue;
+
+		ret = hotplug_card(card, conn_id);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+int platsch_add_device(struct platsch_ctx *ctx, const char *devname)
+{
+	struct platsch_card *card;
+	char *node;
+	int ret;
+
+	for (card = ctx->cards; card; card = card->next)
+		if (!strncmp(card->path, "/dev/", 5) &&
+		    !strcmp(card->path + 5, devname))
+			return -EEXIST;
+
+	ret = asprintf(&node, "/dev/%s", devname);
+	if (ret < 0)
+		return -ENOMEM;
+
+	ret = platsch_open_card(ctx, node, getenv("platsch_device"));
+	free(node);
+	if (ret)
+		return ret;
+
+	/* the new card is the last one */
+	for (card = ctx->cards; card->next; card = card->next)
+		;
+
+	ret = drmprepare(card);
+	if (ret)
+		return ret;
+
+	platsch_draw_card(card);
+
+	if (drmDropMaster(card->drmfd))
+		error("Failed to drop master on %s\n", card->path);
+
+	return 0;
+}
+
+int platsch_remove_device(struct platsch_ctx *ctx, const char *devname)
+{
+	struct platsch_card **iter, *card;
+	struct modeset_dev *dev, *next;
+
+	for (iter = &ctx->cards; *iter; iter = &(*iter)->next)
+		if (!strncmp((*iter)->path, "/dev/", 5) &&
+		    !strcmp((*iter)->path + 5, devname))
+			break;
+
+	card = *iter;
+	if (!card)
+		return -ENOENT;
+
+	debug("%s was removed\n", card->path);
+	*iter = card->next;
+
+	/* the device is gone, so just drop the mappings and close it */
+	for (dev = card->modeset_list; dev; dev = next) {
+		next = dev->next;
+		if (dev->map)
+			munmap(dev->map, dev->size);
+		free(dev->msg_bg);
+		free(dev);
+	}
+
+	/* a pending frame event of the card will never arrive */
+	if (ctx->frame.card == card) {
+		ctx->frame.pending = false;
+		ctx->frame.card = NULL;
+	}
+
+	close(card->drmfd);
+	drmModeFreeResources(card->res);
+	free(card->path);
+	free(card);
+
+	return 0;
+}
+
+int platsch_get_fds(struct platsch_ctx *ctx, int *fds, unsigned int max)
+{
+	struct platsch_card *card;
+	unsigned int n = 0;
+
+	for (card = ctx->cards; card && n < max; card = card->next)
+		fds[n++] = card->drmfd;
+
+	return n;
+}
+
+int platsch_handle_event(struct platsch_ctx *ctx, int fd)
+{
+	struct platsch_card *card;
+
+	for (card = ctx->cards; card; card = card->next)
+		if (card->drmfd == fd)
+			break;
+
+	if (!card)
+		return -ENOENT;
+
+	if (drmHandleEvent(fd, &platsch_evctx))
+		return -errno;
+
+	return 0;
+}
+
+void platsch_release_cpu_mappings(struct platsch_ctx *ctx)
+{
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+
+	for (card = ctx->cards; card; card = card->next) {
+		for (dev = card->modeset_list; dev; dev = dev->next) {
+			/*
+			 * msg_bg is kept, a message on screen would become the
+			 * background of the next one otherwise.
+			 */
+			if (dev->map) {
+				munmap(dev->map, dev->size);
+				dev->map = NULL;
+			}
+		}
+	}
+}
+
+int platsch_keep_scanout(struct platsch_ctx *ctx)
+{
+	struct drm_mode_closefb closefb = { 0 };
+	struct platsch_card *card;
+	struct modeset_dev *dev;
+
+	for (card = ctx->cards; card; card = card->next) {
+		for (dev = card->modeset_list; dev; dev = dev->next) {
+			if (!dev->fb_id)
+				continue;
+
+			closefb.fb_id = dev->fb_id;
+			if (drmIoctl(card->drmfd, DRM_IOCTL_MODE_CLOSEFB, &closefb)) {
+				/* older kernels don't know the ioctl */
+				if (errno == EINVAL || errno == ENOTTY)
+					return -EOPNOTSUPP;
+				error("Cannot close framebuffer %u: %m\n",
+				      dev->fb_id);
+				return -errno;
+			}
+
+			dev->fb_id = 0;
+		}
+	}
+
+	return 0;
+}
+
+int platsch_set_master(struct platsch_ctx *ctx)
+{
+	struct platsch_card *card;
+	int ret = 0;
+
+	for (card = ctx->cards; card; card = card->next) {
+		if (!drmIsMaster(card->drmfd) && drmSetMaster(card->drmfd)) {
+			ret = -errno;
+			error("Failed to become master on %s: %m\n", card->path);
+		}
+	}
+
+	return ret;
+}
+
+void platsch_drop_master(struct platsch_ctx *ctx)
+{
+	struct platsch_card *card;
+
+	for (card = ctx->cards; card; card = card->next) {
+		if (drmIsMaster(card->drmfd) && drmDropMaster(card->drmfd))
+			error("Failed to drop master on %s\n", card->path);
+	}
+}
+
+void platsch_register_custom_draw_cb(struct platsch_ctx *ctx, custom_draw_cb cb,
+				     void *priv)
+{
+	if (!ctx)
+		return;
+
+	ctx->custom_draw_buffer_cb = cb;
+	ctx->custom_draw_priv = priv;
+}
+
+struct platsch_ctx *platsch_create_ctx(const char *dir, const char *base)
+{
+	struct platsch_ctx *ctx;
+	int ret;
+
+	ctx = platsch_alloc_ctx(dir, base);
+	if (!ctx)
+		return NULL;
+
+	ret = platsch_init_ctx(ctx);
+	if (ret) {
+		platsch_destroy_ctx(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+struct platsch_ctx *platsch_alloc_ctx(const char *dir, const char *base)
+{
+	struct platsch_ctx *ctx;
+
+	ctx = platsch_new_ctx(dir, base);
+	if (!ctx)
+		return NULL;
+
+	platsch_open_cards(ctx, getenv("platsch_device"));
+	if (!ctx->cards) {
+		error("Failed to find a drm device\n");
+		platsch_destroy_ctx(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+struct platsch_ctx *platsch_create_ctx_from_fd(int drmfd, const char *dir,
+					       const char *base)
+{
+	struct platsch_ctx *ctx;
+	char *path;
+	int ret;
+
+	ctx = platsch_new_ctx(dir, base);
+	if (!ctx)
+		return NULL;
+
+	path = drmGetDeviceNameFromFd2(drmfd);
+	ret = platsch_add_card(ctx, drmfd, false, path ?: "fd", NULL);
+	free(path);
+	if (ret) {
+		platsch_destroy_ctx(ctx);
+		return NULL;
+	}
+
+	ret = platsch_init_ctx(ctx);
+	if (ret) {
+		platsch_destroy_ctx(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+int platsch_init_ctx(struct platsch_ctx *ctx)
+{
+	return platsch_for_each_card(ctx, drmprepare);
+}
+
+int platsch_init_and_draw(struct platsch_ctx *ctx)
+{
+	return platsch_for_each_card(ctx, platsch_prepare_and_draw_card);
+}
+
+void platsch_destroy_ctx(struct platsch_ctx *ctx)
+{
+	struct platsch_card *card, *next_card;
+	struct modeset_dev *mode, *next;
+
+	for (card = ctx->cards; card; card = next_card) {
+		next_card = card->next;
+
+		for (mode = card->modeset_list; mode;) {
+			next = mode->next;
+			modeset_destroy_fb(card, mode);
+			free(mode->msg_bg);
+			free(mode);
+			mode = next;
+		}
+
+		/* a passed in fd stays as it is, master included */
+		if (card->own_fd) {
+			if (drmIsMaster(card->drmfd) &&
+			    drmDropMaster(card->drmfd))
+				error("Failed to drop master on %s\n",
+				      card->path);
+			close(card->drmfd);
+		}
+
+		drmModeFreeResources(card->res);
+		free(card->path);
+		free(card);
 	}
+	if (ctx->backlight_fd >= 0)
+		close(ctx->backlight_fd);
+	free(ctx->connectors);
+	free(ctx->cache_path);
+	free(ctx->cache_data);
 	free(ctx->dir);
 	free(ctx->base);
 	free(ctx);
@@ -21,16 +21,133 @@ struct platsch_draw_buf {
 	void *fb;
 };
 
+/* brightness levels used for fading, PLATSCH_LEVEL_MAX is unchanged output */
+#define PLATSCH_LEVEL_MAX 0xffff
+
+/*
+ * With more than one DRM device the callback is called concurrently for the
+ * buffers of different devices.
+ */
 typedef void (*custom_draw_cb)(struct platsch_draw_buf *buf, void *priv);
 
 LIBPLATSCH_API void platsch_draw(struct platsch_ctx *ctx);
 LIBPLATSCH_API void platsch_register_custom_draw_cb(struct platsch_ctx *ctx,
 						    custom_draw_cb cb, void *priv);
 
+/*
+ * Light up newly connected connectors. devname is the DEVNAME of a drm uevent
+ * (e.g. "dri/card0") and conn_id its CONNECTOR, both are optional.
+ */
+LIBPLATSCH_API int platsch_handle_hotplug(struct platsch_ctx *ctx,
+					  const char *devname, uint32_t conn_id);
+/*
+ * Follow DRM devices coming and going, e.g. when a native driver replaces
+ * simpledrm. devname is the DEVNAME of the uevent (e.g. "dri/card1"). An added
+ * device is set up and shows the splash right away.
+ */
+LIBPLATSCH_API int platsch_add_device(struct platsch_ctx *ctx,
+				      const char *devname);
+LIBPLATSCH_API int platsch_remove_device(struct platsch_ctx *ctx,
+					 const char *devname);
+/*
+ * Unmap the buffers from the process to save memory while the splash stays on
+ * screen. Drawing maps them again as needed.
+ */
+LIBPLATSCH_API void platsch_release_cpu_mappings(struct platsch_ctx *ctx);
+/*
+ * Close the framebuffers without turning off the outputs (DRM_IOCTL_MODE_CLOSEFB),
+ * so the splash stays on screen after the DRM device is closed. Returns
+ * -EOPNOTSUPP if the kernel doesn't support that (before Linux 6.8).
+ */
+LIBPLATSCH_API int platsch_keep_scanout(struct platsch_ctx *ctx);
+LIBPLATSCH_API int platsch_set_master(struct platsch_ctx *ctx);
+LIBPLATSCH_API void platsch_drop_master(struct platsch_ctx *ctx);
+
+/*
+ * For integration into an event loop: get the DRM fds to watch for POLLIN and
+ * dispatch the DRM events once one of them is readable.
+ */
+LIBPLATSCH_API int platsch_get_fds(struct platsch_ctx *ctx, int *fds,
+				   unsigned int max);
+LIBPLATSCH_API int platsch_handle_event(struct platsch_ctx *ctx, int fd);
+
+/*
+ * The splash buffer of a connector, e.g. for a compositor to show it without
+ * loading the image again. All fields but fd have a fixed size, so they can be
+ * passed to another process as is.
+ */
+struct platsch_dmabuf {
+	uint32_t conn_id;
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	int fd;
+};
+
+/*
+ * Call cb with a dma-buf of every active output. The fd is closed once cb
+ * returns, a non-zero return value stops the export. Returns the number of
+ * exported buffers or a negative error code.
+ */
+typedef int (*platsch_dmabuf_cb)(struct platsch_dmabuf *buf, void *priv);
+LIBPLATSCH_API int platsch_export_dmabufs(struct platsch_ctx *ctx,
+					  platsch_dmabuf_cb cb, void *priv);
+
+/*
+ * Boot feedback drawn over the splash on all outputs: a progress bar (0-100)
+ * and a single line of text. Both go directly to the scanned out buffers, so
+ * call them from a platsch_request_frame() callback to update once per frame.
+ */
+LIBPLATSCH_API void platsch_draw_progress(struct platsch_ctx *ctx,
+					  unsigned int percent);
+LIBPLATSCH_API void platsch_draw_message(struct platsch_ctx *ctx,
+					 const char *message);
+
+/*
+ * Call cb from platsch_handle_event() on the next vblank. Requests made while
+ * one is pending are coalesced. Returns -ENODEV without any active output.
+ */
+typedef void (*platsch_frame_cb)(void *priv);
+LIBPLATSCH_API int platsch_request_frame(struct platsch_ctx *ctx,
+					 platsch_frame_cb cb, void *priv);
+
+LIBPLATSCH_API int platsch_set_level(struct platsch_ctx *ctx, uint16_t level);
+LIBPLATSCH_API int platsch_fade(struct platsch_ctx *ctx, uint16_t from,
+				uint16_t to, unsigned int duration_ms);
+LIBPLATSCH_API int platsch_fade_in(struct platsch_ctx *ctx,
+				   unsigned int duration_ms);
+LIBPLATSCH_API int platsch_fade_out(struct platsch_ctx *ctx,
+				    unsigned int duration_ms);
+LIBPLATSCH_API int platsch_fade_through_black(struct platsch_ctx *ctx,
+					      unsigned int duration_ms);
+
 LIBPLATSCH_API struct platsch_ctx *platsch_create_ctx(const char *dir, const char *base);
 LIBPLATSCH_API struct platsch_ctx *platsch_alloc_ctx(const char *dir, const char *base);
+/* the fd stays owned by the caller */
+LIBPLATSCH_API struct platsch_ctx *platsch_create_ctx_from_fd(int drmfd,
+							      const char *dir,
+							      const char *base);
 LIBPLATSCH_API int platsch_init_ctx(struct platsch_ctx *ctx);
+/*
+ * Like platsch_init_ctx() followed by platsch_draw(), but each output shows the
+ * splash as soon as it is set up, while the next connectors are still probed.
+ */
+LIBPLATSCH_API int platsch_init_and_draw(struct platsch_ctx *ctx);
+/*
+ * Record the current outputs in the topology cache (platsch_cache) for the next
+ * start. This writes and syncs a file, so better call it off the boot's
+ * critical path. Returns -errno if writing failed, e.g. -EROFS while the root
+ * filesystem is still mounted read-only, so it can be tried again later.
+ */
+LIBPLATSCH_API int platsch_write_cache(struct platsch_ctx *ctx);
 
+/*
+ * Free all buffers, which turns the outputs off unless platsch_keep_scanout()
+ * was called before. DRM fds opened by libplatsch are closed.
+ */
 LIBPLATSCH_API void platsch_destroy_ctx(struct platsch_ctx *ctx);
 
 #endif /* __LIBPLATSCH_H__ */
@@ -19,21 +19,46 @@
  * https://raw.githubusercontent.com/dvdhrm/docs/master/drm-howto/modeset.c
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
+#include <malloc.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <signal.h>
+#include <errno.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mount.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
 
 #include "libplatsch.h"
 
 #define debug(fmt, ...) printf("%s:%d: " fmt, __func__, __LINE__, ##__VA_ARGS__)
 #define error(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*a))
+
 static void redirect_stdfd(void)
 {
 	int devnull = open("/dev/null", O_RDWR, 0);
@@ -52,11 +77,1002 @@ static void redirect_stdfd(void)
 	close(devnull);
 }
 
+#if __SIZEOF_POINTER__ == 8
+#define ELFCLASS_NATIVE ELFCLASS64
+#else
+#define ELFCLASS_NATIVE ELFCLASS32
+#endif
+
+#define PREFETCH_MAX	64
+
+/* files prefetched already, to follow each dependency only once */
+struct prefetch {
+	char *seen[PREFETCH_MAX];
+	unsigned int n;
+	/* library directories from ld.so.conf, separated by ':' */
+	char *ldconf;
+};
+
+static void prefetch_elf(struct prefetch *pf, const char *path);
+
+static bool prefetch_seen(struct prefetch *pf, const char *path)
+{
+	unsigned int i;
+
+	for (i = 0; i < pf->n; i++)
+		if (!strcmp(pf->seen[i], path))
+			return true;
+
+	if (pf->n == PREFETCH_MAX)
+		return true;
+
+	pf->seen[pf->n] = strdup(path);
+	if (pf->seen[pf->n])
+		pf->n++;
+
+	return false;
+}
+
+/* NULL unless a NUL terminated string starts at offset off of map */
+static const char *elf_string(const char *map, size_t size, size_t off)
+{
+	if (off >= size || strnlen(map + off, size - off) == size - off)
+		return NULL;
+
+	return map + off;
+}
+
+static size_t elf_vaddr_to_offset(const ElfW(Phdr) *ph, unsigned int phnum,
+				  ElfW(Addr) vaddr)
+{
+	unsigned int i;
+
+	for (i = 0; i < phnum; i++)
+		if (ph[i].p_type == PT_LOAD && vaddr >= ph[i].p_vaddr &&
+		    vaddr < ph[i].p_vaddr + ph[i].p_filesz)
+			return vaddr - ph[i].p_vaddr + ph[i].p_offset;
+
+	return (size_t)-1;
+}
+
+static void prefetch_library(struct prefetch *pf, const char *name,
+			     const char *runpath)
+{
+	static const char *const libdirs = "/lib:/usr/lib:/lib64:/usr/lib64";
+	const char *dirs[] = { runpath, pf->ldconf, libdirs };
+	const char *dir, *end;
+	char path[PATH_MAX];
+	unsigned int i;
+	int len;
+
+	if (strchr(name, '/')) {
+		prefetch_elf(pf, name);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		for (dir = dirs[i]; dir && *dir; dir = *end ? end + 1 : end) {
+			end = strchrnul(dir, ':');
+			len = end - dir;
+
+			/* $ORIGIN and friends are not supported */
+			if (!len || memchr(dir, '$', len))
+				continue;
+
+			snprintf(path, sizeof(path), "%.*s/%s", len, dir, name);
+			if (!access(path, R_OK)) {
+				prefetch_elf(pf, path);
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * Start reading path into the page cache and do the same for the ELF
+ * interpreter and the libraries it needs, as far as they can be found.
+ */
+static void prefetch_elf(struct prefetch *pf, const char *path)
+{
+	const ElfW(Dyn) *dyn = NULL;
+	const ElfW(Ehdr) *eh;
+	const ElfW(Phdr) *ph;
+	const char *interp = NULL, *runpath = NULL, *name;
+	size_t size, strtab = (size_t)-1, ndyn = 0, i;
+	ElfW(Addr) strtab_addr = 0;
+	size_t runpath_off = (size_t)-1;
+	struct stat st;
+	char *map;
+	int fd;
+
+	if (prefetch_seen(pf, path))
+		return;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return;
+	}
+	size = st.st_size;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	eh = (const ElfW(Ehdr) *)map;
+	if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS_NATIVE ||
+	    eh->e_phoff > size ||
+	    eh->e_phnum > (size - eh->e_phoff) / sizeof(*ph))
+		goto out;
+
+	ph = (const ElfW(Phdr) *)(map + eh->e_phoff);
+
+	for (i = 0; i < eh->e_phnum; i++) {
+		if (ph[i].p_type == PT_INTERP) {
+			interp = elf_string(map, size, ph[i].p_offset);
+		} else if (ph[i].p_type == PT_DYNAMIC &&
+			   ph[i].p_offset <= size &&
+			   ph[i].p_filesz <= size - ph[i].p_offset) {
+			dyn = (const ElfW(Dyn) *)(map + ph[i].p_offset);
+			ndyn = ph[i].p_filesz / sizeof(*dyn);
+		}
+	}
+
+	if (interp)
+		prefetch_elf(pf, interp);
+
+	for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+		if (dyn[i].d_tag == DT_STRTAB)
+			strtab_addr = dyn[i].d_un.d_ptr;
+		else if (dyn[i].d_tag == DT_RUNPATH || dyn[i].d_tag == DT_RPATH)
+			runpath_off = dyn[i].d_un.d_val;
+	}
+
+	if (strtab_addr)
+		strtab = elf_vaddr_to_offset(ph, eh->e_phnum, strtab_addr);
+	if (strtab == (size_t)-1)
+		goto out;
+
+	if (runpath_off != (size_t)-1)
+		runpath = elf_string(map, size, strtab + runpath_off);
+
+	for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++) {
+		if (dyn[i].d_tag != DT_NEEDED)
+			continue;
+
+		name = elf_string(map, size, strtab + dyn[i].d_un.d_val);
+		if (name)
+			prefetch_library(pf, name, runpath);
+	}
+
+out:
+	munmap(map, size);
+}
+
+/* collect the directories of an ld.so.conf, following include directives */
+static void prefetch_read_ldconf(struct prefetch *pf, const char *path,
+				 int depth)
+{
+	char *line = NULL, *dir, *tmp;
+	size_t len = 0;
+	glob_t gl;
+	size_t i;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f)
+		return;
+
+	while (getline(&line, &len, f) > 0) {
+		line[strcspn(line, "#\n")] = '\0';
+		dir = line + strspn(line, " \t");
+		if (!*dir)
+			continue;
+
+		if (!strncmp(dir, "include", 7) && isspace(dir[7])) {
+			dir += 8 + strspn(dir + 8, " \t");
+			if (depth > 2 || glob(dir, 0, NULL, &gl))
+				continue;
+			for (i = 0; i < gl.gl_pathc; i++)
+				prefetch_read_ldconf(pf, gl.gl_pathv[i],
+						     depth + 1);
+			globfree(&gl);
+			continue;
+		}
+
+		dir[strcspn(dir, " \t")] = '\0';
+		if (asprintf(&tmp, "%s%s%s", pf->ldconf ?: "",
+			     pf->ldconf ? ":" : "", dir) < 0)
+			break;
+		free(pf->ldconf);
+		pf->ldconf = tmp;
+	}
+
+	free(line);
+	fclose(f);
+}
+
+static void *prefetch_thread(void *arg)
+{
+	const char *env = getenv("platsch_prefetch");
+	struct prefetch pf = { .n = 0 };
+	char *list, *path, *saveptr;
+	unsigned int i;
+
+	(void)arg;
+
+	prefetch_read_ldconf(&pf, "/etc/ld.so.conf", 0);
+
+	if (env) {
+		list = strdup(env);
+		if (!list)
+			return NULL;
+
+		for (path = strtok_r(list, ":, ", &saveptr); path;
+		     path = strtok_r(NULL, ":, ", &saveptr))
+			prefetch_elf(&pf, path);
+
+		free(list);
+	} else {
+		prefetch_elf(&pf, "/sbin/init");
+	}
+
+	debug("prefetched %u files\n", pf.n);
+
+	for (i = 0; i < pf.n; i++)
+		free(pf.seen[i]);
+	free(pf.ldconf);
+
+	return NULL;
+}
+
+/*
+ * Warm up the page cache for exec'ing init while platsch waits for the display
+ * hardware. Exec'ing init ends the thread if it isn't done yet.
+ */
+static pthread_t prefetch_tid;
+static bool prefetch_running;
+
+static void prefetch_start(void)
+{
+	const char *env = getenv("platsch_prefetch");
+	int ret;
+
+	if (env && !*env)
+		return;
+
+	ret = pthread_create(&prefetch_tid, NULL, prefetch_thread, NULL);
+	if (ret) {
+		error("Failed to start prefetching: %s\n", strerror(ret));
+		return;
+	}
+
+	prefetch_running = true;
+}
+
+/*
+ * A forked child inherits locks (e.g. of malloc or stdio) held by the thread
+ * at that moment, so it has to be done before forking. Exec'ing is fine.
+ */
+static void prefetch_finish(void)
+{
+	if (!prefetch_running)
+		return;
+
+	pthread_join(prefetch_tid, NULL);
+	prefetch_running = false;
+}
+
+static int uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* kernel events, there is no udev yet */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		error("Failed to open uevent socket: %m\n");
+		return -1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		error("Failed to bind uevent socket: %m\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void uevent_handle(struct platsch_ctx *ctx, int fd)
+{
+	const char *action = NULL, *subsystem = NULL, *devname = NULL;
+	struct sockaddr_nl addr;
+	socklen_t addrlen = sizeof(addr);
+	uint32_t conn_id = 0;
+	bool hotplug = false;
+	char buf[4096], *p;
+	ssize_t len;
+
+	len = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr,
+		       &addrlen);
+	if (len <= 0 || addr.nl_pid != 0)
+		return;
+	buf[len] = '\0';
+
+	/* "<action>@<devpath>" followed by "KEY=value" strings */
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+		else if (!strcmp(p, "HOTPLUG=1"))
+			hotplug = true;
+		else if (!strncmp(p, "CONNECTOR=", 10))
+			conn_id = strtoul(p + 10, NULL, 10);
+	}
+
+	if (!action || !subsystem || strcmp(subsystem, "drm"))
+		return;
+
+	/* connectors are drm devices as well, but without a device node */
+	if (devname && !strncmp(devname, "dri/card", 8)) {
+		if (!strcmp(action, "remove")) {
+			platsch_remove_device(ctx, devname);
+			return;
+		} else if (!strcmp(action, "add")) {
+			debug("new drm device %s\n", devname);
+			platsch_add_device(ctx, devname);
+			return;
+		}
+	}
+
+	if (strcmp(action, "change") || !hotplug)
+		return;
+
+	debug("hotplug on %s, connector #%u\n", devname, conn_id);
+	platsch_handle_hotplug(ctx, devname, conn_id);
+}
+
+static unsigned int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* a duration in milliseconds, clamped to what poll() can wait */
+static unsigned int parse_ms(const char *str)
+{
+	unsigned long ms;
+
+	errno = 0;
+	ms = strtoul(str, NULL, 10);
+	if (errno == ERANGE || ms > INT_MAX)
+		ms = INT_MAX;
+
+	return ms;
+}
+
+/* a leading '@' selects the abstract namespace, which is immune to mounts */
+static socklen_t socket_addr(struct sockaddr_un *addr, const char *env,
+			     const char *def)
+{
+	const char *path = getenv(env) ?: def;
+	size_t len = strlen(path);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (len >= sizeof(addr->sun_path))
+		len = sizeof(addr->sun_path) - 1;
+	memcpy(addr->sun_path, path, len);
+
+	if (path[0] == '@') {
+		addr->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + len;
+	}
+
+	return sizeof(*addr);
+}
+
+static int socket_open(int type, const char *env, const char *def)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen = socket_addr(&addr, env, def);
+	int fd;
+
+	fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		error("Failed to open %s: %m\n", env);
+		return -1;
+	}
+
+	/* a stale socket from an earlier run would make bind fail */
+	if (addr.sun_path[0])
+		unlink(addr.sun_path);
+
+	if (bind(fd, (struct sockaddr *)&addr, addrlen)) {
+		error("Failed to bind %s: %m\n", env);
+		close(fd);
+		return -1;
+	}
+
+	if (type == SOCK_STREAM && listen(fd, 4)) {
+		error("Failed to listen on %s: %m\n", env);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Abstract sockets have no file permissions, so check who is talking to us:
+ * root, our own user or the one given in platsch_socket_uid.
+ */
+static bool socket_peer_allowed(uid_t uid)
+{
+	const char *env = getenv("platsch_socket_uid");
+
+	if (uid == 0 || uid == getuid())
+		return true;
+
+	return env && *env && uid == strtoul(env, NULL, 10);
+}
+
+static int control_send(const char *cmd)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen = socket_addr(&addr, "platsch_socket", "@platsch");
+	int fd, ret = 0;
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		error("Failed to open control socket: %m\n");
+		return -errno;
+	}
+
+	if (sendto(fd, cmd, strlen(cmd), 0, (struct sockaddr *)&addr,
+		   addrlen) < 0) {
+		ret = -errno;
+		error("Failed to send \"%s\": %m\n", cmd);
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static int dmabuf_send(struct platsch_dmabuf *buf, void *priv)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = offsetof(struct platsch_dmabuf, fd),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf),
+	};
+	int *fd = priv;
+
+	memset(&cmsg, 0, sizeof(cmsg));
+	cmsg.hdr.cmsg_level = SOL_SOCKET;
+	cmsg.hdr.cmsg_type = SCM_RIGHTS;
+	cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(&cmsg.hdr), &buf->fd, sizeof(int));
+
+	/* a client not reading must not stall the resident child */
+	if (sendmsg(*fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+		error("Failed to send dma-buf of connector #%u: %m\n",
+		      buf->conn_id);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand the splash buffers to a connecting compositor: one message per output
+ * with the dma-buf attached, the end is marked by closing the connection.
+ */
+static void dmabuf_handle(struct platsch_ctx *ctx, int fd)
+{
+	socklen_t len = sizeof(struct ucred);
+	struct ucred cred;
+	int conn;
+
+	conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (conn < 0)
+		return;
+
+	/* the dma-bufs give write access to what is on screen */
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		error("Failed to get credentials of dma-buf client: %m\n");
+		goto out;
+	}
+
+	if (!socket_peer_allowed(cred.uid)) {
+		error("Refusing dma-bufs to uid %u\n", cred.uid);
+		goto out;
+	}
+
+	platsch_export_dmabufs(ctx, dmabuf_send, &conn);
+out:
+	close(conn);
+}
+
+struct resident_loop {
+	struct platsch_ctx *ctx;
+	int epfd;
+	int sigfd;
+	int ueventfd;
+	int ctlfd;
+	int dmabuffd;
+	/* the topology cache still has to be written, retried on mount changes */
+	bool cache_pending;
+	int mountfd;
+	int drmfds[16];
+	int n_drmfds;
+
+	/* control requests not yet drawn, applied once per frame */
+	int progress;
+	char message[128];
+	bool new_message;
+
+	/* a running fade-out, one step per frame */
+	bool fading;
+	struct timespec fade_start;
+	unsigned int fade_ms;
+};
+
+static void __attribute__((noreturn)) resident_exit(struct resident_loop *loop)
+{
+	/* last chance for the cache, e.g. before shutdown remounts read-only */
+	if (loop->cache_pending)
+		platsch_write_cache(loop->ctx);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void control_frame(void *priv)
+{
+	struct resident_loop *loop = priv;
+	unsigned int elapsed;
+	uint16_t level = 0;
+
+	if (loop->progress >= 0) {
+		platsch_draw_progress(loop->ctx, loop->progress);
+		loop->progress = -1;
+	}
+
+	if (loop->new_message) {
+		platsch_draw_message(loop->ctx, loop->message);
+		loop->new_message = false;
+	}
+
+	if (!loop->fading)
+		return;
+
+	elapsed = elapsed_ms(&loop->fade_start);
+	if (elapsed < loop->fade_ms)
+		level = (uint64_t)PLATSCH_LEVEL_MAX * (loop->fade_ms - elapsed) /
+			loop->fade_ms;
+
+	platsch_set_level(loop->ctx, level);
+
+	/* without any active output there won't be a vblank to wait for */
+	if (level && !platsch_request_frame(loop->ctx, control_frame, loop))
+		return;
+
+	if (level)
+		platsch_set_level(loop->ctx, 0);
+
+	/* the compositor might be waiting for DRM master */
+	loop->fading = false;
+	platsch_drop_master(loop->ctx);
+}
+
+static bool control_recv_allowed(int fd, char *buf, size_t size)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(struct ucred))];
+	} cmsg;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = size - 1,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf),
+	};
+	struct cmsghdr *hdr;
+	struct ucred cred;
+	ssize_t len;
+
+	len = recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+
+	/* with SO_PASSCRED the kernel always attaches the sender's credentials */
+	hdr = CMSG_FIRSTHDR(&msg);
+	if (!hdr || hdr->cmsg_level != SOL_SOCKET ||
+	    hdr->cmsg_type != SCM_CREDENTIALS)
+		return false;
+	memcpy(&cred, CMSG_DATA(hdr), sizeof(cred));
+
+	if (!socket_peer_allowed(cred.uid)) {
+		error("Ignoring command from uid %u\n", cred.uid);
+		return false;
+	}
+
+	return true;
+}
+
+static void control_handle(struct resident_loop *loop, int fd)
+{
+	char buf[256], *arg;
+
+	if (!control_recv_allowed(fd, buf, sizeof(buf)))
+		return;
+	buf[strcspn(buf, "\n")] = '\0';
+
+	arg = strchr(buf, ' ');
+	if (arg)
+		*arg++ = '\0';
+	else
+		arg = "";
+
+	if (!strcmp(buf, "progress")) {
+		loop->progress = strtoul(arg, NULL, 10);
+		if (loop->progress > 100)
+			loop->progress = 100;
+	} else if (!strcmp(buf, "message")) {
+		snprintf(loop->message, sizeof(loop->message), "%s", arg);
+		loop->new_message = true;
+	} else if (!strcmp(buf, "fade-out")) {
+		if (!loop->fading)
+			platsch_set_master(loop->ctx);
+		loop->fading = true;
+		loop->fade_ms = *arg ? strtoul(arg, NULL, 10) : 500;
+		clock_gettime(CLOCK_MONOTONIC, &loop->fade_start);
+	} else if (!strcmp(buf, "quit")) {
+		debug("exiting on request\n");
+		resident_exit(loop);
+	} else {
+		error("Unknown command \"%s\"\n", buf);
+		return;
+	}
+
+	/* without any active output there won't be a vblank to wait for */
+	if (platsch_request_frame(loop->ctx, control_frame, loop))
+		control_frame(loop);
+}
+
+static int resident_add_fd(struct resident_loop *loop, int fd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.fd = fd,
+	};
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) && errno != EEXIST) {
+		error("Failed to watch fd %d: %m\n", fd);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/* DRM devices come and go with uevents, so keep watching the current ones */
+static void resident_update_drmfds(struct resident_loop *loop,
+				   struct platsch_ctx *ctx)
+{
+	int fds[ARRAY_SIZE(loop->drmfds)];
+	int n, i, j;
+
+	n = platsch_get_fds(ctx, fds, ARRAY_SIZE(fds));
+	if (n < 0)
+		return;
+
+	for (i = 0; i < loop->n_drmfds; i++) {
+		for (j = 0; j < n; j++)
+			if (fds[j] == loop->drmfds[i])
+				break;
+
+		/* closing the fd already removed it from epoll */
+		if (j == n)
+			epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->drmfds[i], NULL);
+	}
+
+	/* a new device might have gotten the fd number of a removed one */
+	for (j = 0; j < n; j++)
+		resident_add_fd(loop, fds[j]);
+
+	memcpy(loop->drmfds, fds, n * sizeof(*fds));
+	loop->n_drmfds = n;
+}
+
+static int resident_init(struct resident_loop *loop, struct platsch_ctx *ctx)
+{
+	sigset_t mask;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		error("Failed to create epoll instance: %m\n");
+		return -errno;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	loop->sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (loop->sigfd >= 0)
+		resident_add_fd(loop, loop->sigfd);
+	else
+		error("Failed to create signalfd: %m\n");
+
+	loop->ueventfd = uevent_open();
+	if (loop->ueventfd >= 0)
+		resident_add_fd(loop, loop->ueventfd);
+
+	loop->ctlfd = socket_open(SOCK_DGRAM, "platsch_socket", "@platsch");
+	if (loop->ctlfd >= 0 &&
+	    setsockopt(loop->ctlfd, SOL_SOCKET, SO_PASSCRED, &(int){ 1 },
+		       sizeof(int))) {
+		error("Failed to enable credentials on control socket: %m\n");
+		close(loop->ctlfd);
+		loop->ctlfd = -1;
+	}
+	if (loop->ctlfd >= 0)
+		resident_add_fd(loop, loop->ctlfd);
+
+	loop->dmabuffd = socket_open(SOCK_STREAM, "platsch_dmabuf_socket",
+				     "@platsch-dmabuf");
+	if (loop->dmabuffd >= 0)
+		resident_add_fd(loop, loop->dmabuffd);
+
+	/*
+	 * The root filesystem is often still mounted read-only now, so try
+	 * writing the topology cache again on every mount change.
+	 */
+	loop->mountfd = -1;
+	loop->cache_pending = platsch_write_cache(ctx);
+	if (loop->cache_pending) {
+		struct epoll_event ev = { .events = EPOLLPRI };
+
+		loop->mountfd = open("/proc/self/mountinfo",
+				     O_RDONLY | O_CLOEXEC);
+		ev.data.fd = loop->mountfd;
+		if (loop->mountfd >= 0 &&
+		    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->mountfd, &ev))
+			error("Failed to watch mounts: %m\n");
+	}
+
+	loop->ctx = ctx;
+	loop->progress = -1;
+	loop->new_message = false;
+	loop->fading = false;
+
+	loop->n_drmfds = 0;
+	resident_update_drmfds(loop, ctx);
+
+	return 0;
+}
+
+static void report_rss(void)
+{
+	unsigned long size, rss;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "re");
+	if (!f)
+		return;
+
+	if (fscanf(f, "%lu %lu", &size, &rss) == 2)
+		debug("staying resident with %lu kB RSS\n",
+		      rss * sysconf(_SC_PAGESIZE) / 1024);
+
+	fclose(f);
+}
+
+/*
+ * Keep the drm device open, light up hotplugged connectors, draw the boot
+ * progress sent to the control socket and handle drm events. Everything is
+ * event driven, so this doesn't use any CPU when idle.
+ */
+static void __attribute__((noreturn)) resident(struct platsch_ctx *ctx)
+{
+	struct epoll_event events[8];
+	struct signalfd_siginfo si;
+	struct resident_loop loop;
+	int n, i, fd;
+
+	/*
+	 * This process lives as long as the device, so drop what isn't needed
+	 * anymore. Drawing progress or hotplugged outputs maps buffers again.
+	 */
+	platsch_release_cpu_mappings(ctx);
+	malloc_trim(0);
+	report_rss();
+
+	redirect_stdfd();
+
+	if (resident_init(&loop, ctx))
+		goto sleep;
+
+	while (1) {
+		n = epoll_wait(loop.epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			error("Failed to wait for events: %m\n");
+			goto sleep;
+		}
+
+		for (i = 0; i < n; i++) {
+			fd = events[i].data.fd;
+
+			if (fd == loop.sigfd) {
+				if (read(fd, &si, sizeof(si)) == sizeof(si)) {
+					debug("exiting on signal %u\n", si.ssi_signo);
+					resident_exit(&loop);
+				}
+			} else if (fd == loop.ueventfd) {
+				uevent_handle(ctx, fd);
+				resident_update_drmfds(&loop, ctx);
+			} else if (fd == loop.ctlfd) {
+				control_handle(&loop, fd);
+			} else if (fd == loop.dmabuffd) {
+				dmabuf_handle(ctx, fd);
+			} else if (fd == loop.mountfd) {
+				if (!platsch_write_cache(ctx)) {
+					loop.cache_pending = false;
+					close(loop.mountfd);
+					loop.mountfd = -1;
+				}
+			} else {
+				platsch_handle_event(ctx, fd);
+			}
+		}
+	}
+
+sleep:
+	do {
+		sleep(10);
+	} while (1);
+}
+
+/*
+ * The kernel only mounts devtmpfs for init if configured to do so, and never
+ * sysfs, which is needed to find DRM devices by their by-path name.
+ */
+static void mount_early(const char *fstype, const char *target)
+{
+	struct stat root, dir;
+
+	if (stat("/", &root) || stat(target, &dir))
+		return;
+
+	/* something is mounted there already */
+	if (root.st_dev != dir.st_dev)
+		return;
+
+	if (mount(fstype, target, fstype, 0, NULL))
+		error("Failed to mount %s: %m\n", fstype);
+}
+
+static bool dri_present(void)
+{
+	struct dirent *ent;
+	bool found = false;
+	DIR *dir;
+
+	dir = opendir("/dev/dri");
+	if (!dir)
+		return false;
+
+	while (!found && (ent = readdir(dir)))
+		found = !strncmp(ent->d_name, "card", 4);
+
+	closedir(dir);
+
+	return found;
+}
+
+/*
+ * At early boot the display driver might not have probed yet (e.g. because of
+ * deferred probing), so wait for a DRM device to show up, but not longer than
+ * timeout_ms.
+ */
+static void wait_for_dri(unsigned int timeout_ms)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .events = POLLIN };
+	struct timespec start;
+	unsigned int elapsed;
+	int wd = -1;
+
+	if (dri_present())
+		return;
+
+	pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (pfd.fd < 0) {
+		error("Failed to set up inotify: %m\n");
+		return;
+	}
+
+	if (inotify_add_watch(pfd.fd, "/dev", IN_CREATE | IN_ONLYDIR) < 0) {
+		error("Failed to watch /dev: %m\n");
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (1) {
+		/* /dev/dri can only be watched once it exists */
+		if (wd < 0)
+			wd = inotify_add_watch(pfd.fd, "/dev/dri",
+					       IN_CREATE | IN_ONLYDIR);
+
+		/* check after adding the watch to not miss a new device */
+		if (dri_present()) {
+			debug("DRM device appeared after %u ms\n",
+			      elapsed_ms(&start));
+			break;
+		}
+
+		elapsed = elapsed_ms(&start);
+		if (elapsed >= timeout_ms) {
+			error("No DRM device after %u ms\n", timeout_ms);
+			break;
+		}
+
+		if (poll(&pfd, 1, timeout_ms - elapsed) < 0 && errno != EINTR)
+			break;
+
+		/* the events don't matter, dri_present() checks anyway */
+		while (read(pfd.fd, buf, sizeof(buf)) > 0)
+			;
+	}
+
+out:
+	close(pfd.fd);
+}
+
 static struct option longopts[] =
 {
 	{ "help",      no_argument,       0, 'h' },
 	{ "directory", required_argument, 0, 'd' },
 	{ "basename",  required_argument, 0, 'b' },
+	{ "device",    required_argument, 0, 'D' },
+	{ "send",      required_argument, 0, 's' },
 	{ NULL,        0,                 0, 0   }
 };
 
@@ -64,18 +1080,46 @@ static void usage(const char *prog)
 {
 	error("Usage:\n"
 	      "%s [-d|--directory <dir>] [-b|--basename <name>]\n"
-	      "   [-h|--help]\n",
-	      prog);
+	      "   [-D|--device <device>] [-h|--help]\n"
+	      "%s -s|--send <command>\n",
+	      prog, prog);
 }
 
-int main(int argc, char *argv[])
+static void __attribute__((noreturn)) exec_init(int argc, char *argv[])
 {
 	char **initsargv;
+
+	initsargv = calloc(argc + 1, sizeof(argv[0]));
+	if (!initsargv) {
+		error("failed to allocate argv for init\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(initsargv, argv, argc * sizeof(argv[0]));
+	initsargv[0] = "/sbin/init";
+	initsargv[argc] = NULL;
+
+	execv("/sbin/init", initsargv);
+
+	error("failed to exec init: %m\n");
+
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
 	struct platsch_ctx *ctx;
 	bool pid1 = getpid() == 1;
+	bool early = pid1;
 	const char *dir = NULL;
 	const char *base = NULL;
 	const char *env;
+	unsigned int fadein_ms = 0;
+	bool stay_resident = true;
+	/* no budget: show the splash first, then start init */
+	bool budget = false;
+	unsigned int budget_ms = 0;
+	int donefd[2] = { -1, -1 };
+	unsigned int device_timeout_ms;
 	int ret = 0, c;
 
 	env = getenv("platsch_directory");
@@ -86,8 +1130,32 @@ int main(int argc, char *argv[])
 	if (env)
 		base = env;
 
+	env = getenv("platsch_fadein_ms");
+	if (env)
+		fadein_ms = strtoul(env, NULL, 10);
+
+	env = getenv("platsch_resident");
+	if (env)
+		stay_resident = strtoul(env, NULL, 10);
+
+	env = getenv("platsch_async");
+	if (env && strtoul(env, NULL, 10))
+		budget = true;
+
+	env = getenv("platsch_budget_ms");
+	if (env) {
+		budget = true;
+		budget_ms = parse_ms(env);
+	}
+
+	/* boards without a display must not pay for waiting, so it's opt-in */
+	device_timeout_ms = 0;
+	env = getenv("platsch_device_timeout_ms");
+	if (env)
+		device_timeout_ms = parse_ms(env);
+
 	if (!pid1) {
-		while ((c = getopt_long(argc, argv, "hd:b:", longopts, NULL)) != EOF) {
+		while ((c = getopt_long(argc, argv, "hd:b:D:s:", longopts, NULL)) != EOF) {
 			switch(c) {
 			case 'd':
 				dir = optarg;
@@ -95,6 +1163,13 @@ int main(int argc, char *argv[])
 			case 'b':
 				base = optarg;
 				break;
+			case 'D':
+				/* libplatsch picks the device from the environment */
+				setenv("platsch_device", optarg, 1);
+				break;
+			case 's':
+				/* talk to the resident instance and leave */
+				exit(control_send(optarg) ? EXIT_FAILURE : EXIT_SUCCESS);
 			case '?':
 				/* ‘getopt_long’ already printed an error message. */
 				ret = 1;
@@ -112,46 +1187,126 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	ctx = platsch_create_ctx(dir, base);
-	if (!ctx)
+	if (early) {
+		mount_early("devtmpfs", "/dev");
+		mount_early("sysfs", "/sys");
+	}
+
+	/*
+	 * Don't hold up the boot longer than the budget: the child shows the
+	 * splash and closes its end of the pipe once done, init starts then or
+	 * when the budget is used up. The child carries on regardless and
+	 * stays resident afterwards as usual.
+	 */
+	if (pid1 && budget) {
+		if (pipe2(donefd, O_CLOEXEC)) {
+			error("failed to create pipe: %m\n");
+			donefd[0] = donefd[1] = -1;
+		}
+
+		ret = fork();
+		if (ret < 0) {
+			error("failed to fork for the splash: %m\n");
+		} else if (ret > 0) {
+			if (budget_ms && donefd[0] >= 0) {
+				struct pollfd pfd = {
+					.fd = donefd[0],
+					.events = POLLIN,
+				};
+
+				close(donefd[1]);
+				prefetch_start();
+				if (!poll(&pfd, 1, budget_ms))
+					error("splash not done within %u ms, starting init\n",
+					      budget_ms);
+			}
+			exec_init(argc, argv);
+		} else {
+			pid1 = false;
+			close(donefd[0]);
+		}
+	}
+
+	if (pid1)
+		prefetch_start();
+
+	if (device_timeout_ms)
+		wait_for_dri(device_timeout_ms);
+
+	/*
+	 * Without fading in, each output shows the splash as soon as it is set
+	 * up. Fading needs all of them set up to start from black.
+	 */
+	ctx = platsch_alloc_ctx(dir, base);
+	if (ctx && (fadein_ms ? platsch_init_ctx(ctx) :
+				platsch_init_and_draw(ctx))) {
+		platsch_destroy_ctx(ctx);
+		ctx = NULL;
+	}
+
+	if (!ctx) {
+		/* no splash is no reason to not boot */
+		if (pid1)
+			exec_init(argc, argv);
 		return EXIT_FAILURE;
+	}
+
+	if (fadein_ms) {
+		platsch_set_level(ctx, 0);
+		platsch_draw(ctx);
+		platsch_fade_in(ctx, fadein_ms);
+	}
+
+	/* let others take over, hotplug handling takes master as needed */
+	platsch_drop_master(ctx);
 
-	platsch_draw(ctx);
+	/* tell the parent to start init */
+	if (donefd[1] >= 0)
+		close(donefd[1]);
 
-	platsch_destroy_ctx(ctx);
+	/*
+	 * Without a resident child the splash has to survive closing the DRM
+	 * device, fall back to the child if the kernel can't do that.
+	 */
+	if (!stay_resident && platsch_keep_scanout(ctx)) {
+		debug("cannot keep the splash on screen, staying resident\n");
+		stay_resident = true;
+	}
+
+	/* nothing may hold a lock in a forked child */
+	prefetch_finish();
+
+	if (!stay_resident) {
+		/* write the cache while init (or whatever is next) starts */
+		ret = getenv("platsch_cache") ? fork() : 1;
+		if (ret == 0) {
+			platsch_write_cache(ctx);
+			_exit(EXIT_SUCCESS);
+		} else if (ret < 0) {
+			platsch_write_cache(ctx);
+		}
+
+		platsch_destroy_ctx(ctx);
+		ctx = NULL;
+	}
 
 	if (pid1) {
-		ret = fork();
+		ret = stay_resident ? fork() : 1;
 		if (ret < 0) {
 			error("failed to fork for init: %m\n");
 		} else if (ret == 0) {
 			/*
-			 * in the child go to sleep to keep the drm device open
-			 * and give pid 1 to init.
+			 * in the child stay resident to keep the drm device
+			 * open and give pid 1 to init.
 			 */
-			goto sleep;
-		}
-
-		initsargv = calloc(argc + 1, sizeof(argv[0]));
-		if (!initsargv) {
-			error("failed to allocate argv for init\n");
-			return EXIT_FAILURE;
+			resident(ctx);
 		}
-		memcpy(initsargv, argv, argc * sizeof(argv[0]));
-		initsargv[0] = "/sbin/init";
-		initsargv[argc] = NULL;
-
-		execv("/sbin/init", initsargv);
-
-		error("failed to exec init: %m\n");
 
-		return EXIT_FAILURE;
+		exec_init(argc, argv);
 	}
 
-sleep:
-	redirect_stdfd();
+	if (!stay_resident)
+		return EXIT_SUCCESS;
 
-	do {
-		sleep(10);
-	} while (1);
+	resident(ctx);
 }